@@ -6,110 +6,216 @@
 #include <iostream>
 #include <semaphore>
 #include <sstream>
+#include <string>
+#include <unordered_map>
 #include <ranges>
 #include <future>
 #include <variant>
+#include "Public/ThreadPool.h"
+#include "Public/Preassigned.h"
+#include "Public/Queued.h"
+#include "Public/AtomicQueued.h"
+#include "Public/Pooled.h"
+#include "Public/Hybrid.h"
+#include "Public/Split.h"
+#include "Public/Ingest.h"
+#include "Public/Validation.h"
+#include "Public/Benchmark.h"
+#include "Public/popl.hpp"
 
 namespace rn = std::ranges;
 namespace vi = std::views;
 
-namespace tk {
-    
-class thread_pool {
+// load_path names a dataset file to map instead of generating the dataset, empty to generate it
+int run_experiment(const std::string& name, DatasetType type, const numa::placement& placement, const experiment_settings& settings, const std::string& load_path = {})
+{
+    static const std::unordered_map<std::string, int(*)(stm::chunk_source, const experiment_settings&)> experiments
+    {
+        {"pre", &pre::do_experiment},
+        {"que", &que::do_Experiment},
+        {"atq", &atq::do_Experiment},
+        {"pld", &pld::do_experiment},
+        {"hyb", &hyb::do_experiment},
+        {"spl", &spl::do_experiment},
+        {"ing", &ing::do_experiment},
+        {"locks", &que::do_Lock_Sweep},
+    };
+    static const std::unordered_map<std::string, int(*)(const soa::dataset&, const experiment_settings&)> soa_experiments
+    {
+        {"pre", &pre::do_experiment},
+        {"pld", &pld::do_experiment},
+    };
 
-    using task = std::move_only_function<void()>;
-public:
-    thread_pool(std::size_t in_workers_count) {
-        workers_.reserve(in_workers_count);
-        for(size_t i = 0; i < in_workers_count; i++) {
-            workers_.emplace_back(this);
-        }
+    const auto it = experiments.find(name);
+    if(it == experiments.end())
+    {
+        throw std::invalid_argument{std::format("Unknown experiment: {}", name)};
     }
 
-    template<typename FuncType, typename... Params>
-    auto run(FuncType&& function, Params&&... params)
-    {
-        using ret_type = std::invoke_result_t<FuncType, Params...>;
-        auto pak = std::packaged_task<ret_type()>{std::bind(
-            std::forward<FuncType>(function), std::forward<Params>(params)...
-        )};
-        auto future = pak.get_future();
-        task t = {
-            [pak = std::move(pak)]() mutable
-            {
-                pak();
-            }
-        };
-        
+    if(!load_path.empty() && (settings.layout == task_layout::soa || settings.stream_depth > 0))
+    {
+        throw std::invalid_argument{"A dataset file is mapped as it is, run it without --layout soa and --stream"};
+    }
+
+    if(settings.layout == task_layout::soa)
+    {
+        const auto it_soa = soa_experiments.find(name);
+        if(it_soa == soa_experiments.end())
+        {
+            throw std::invalid_argument{std::format("{} has no SoA path, the SoA layout runs with pre and pld", name)};
+        }
+        if(settings.stream_depth > 0)
         {
-            std::lock_guard lock{task_queue_mutex_};
-            tasks_.push_back(std::move(t));
+            throw std::invalid_argument{"The SoA layout is generated up front, run it without --stream"};
         }
-        
-        cvar_queue_task_.notify_one();
-        return future;
+        std::cout << std::format("Kernel: {}\n", simd_level_name(simd::resolve(settings.kernel)));
+
+        MyTimer generation_timer;
+        generation_timer.Mark();
+        const auto data = soa::generate(type, placement, settings.seed, settings.generation_threads);
+        std::cout << std::format("Dataset: {} KB generated in {:.4f}s\n", data.size() * sizeof(soa::chunk) / 1024, generation_timer.Peek());
+        return it_soa->second(data, settings);
     }
 
-    void wait_for_all_done() {
-        std::unique_lock ulock{task_queue_mutex_};
-        cvar_all_done_.wait(ulock, [this]{return tasks_.empty();});
+    if(settings.kernel != simd_level::scalar && name != "spl")
+    {
+        throw std::invalid_argument{"The batch kernels run on the SoA layout and on spl's light lane, add --layout soa or run spl"};
     }
 
-    ~thread_pool() {
-        for(auto& worker : workers_) {
-            worker.request_stop();
-        }
+    if(!load_path.empty())
+    {
+        MyTimer map_timer;
+        map_timer.Mark();
+        const dsf::mapped_dataset file{load_path};
+        std::cout << std::format("Dataset: {} KB mapped from {} in {:.4f}s, {} chunks of the {} dataset with seed {}\n", file.file_bytes() / 1024, load_path,
+            map_timer.Peek(), file.size(), dataset_type_name(file.type()), file.header().seed);
+        return it->second(file, settings);
     }
 
-private:
-    class worker {
-    public:
-        worker(thread_pool* pool) : p_pool_(pool), thread_(std::bind_front(&worker::run_kernel_, this)){}
+    if(settings.stream_depth > 0)
+    {
+        stm::chunk_stream stream{type, placement, settings.stream_depth, settings.seed};
+        const int result = it->second(stream, settings);
+        std::cout << std::format("Stream: {} KB of chunk buffers, first chunk done after {:.4f}s, engine waited {:.4f}s for chunks, generator {:.4f}s for buffers\n",
+            stream.buffer_bytes() / 1024, stream.time_to_first_chunk(), stream.consumer_wait(), stream.generator_wait());
+        return result;
+    }
 
-        void request_stop() {
-            thread_.request_stop();
-        }
+    MyTimer generation_timer;
+    generation_timer.Mark();
+    auto data = generate_data_sets_by_type(type, placement, settings.seed, settings.generation_threads);
+    std::cout << std::format("Dataset: {} KB generated in {:.4f}s\n", data.size() * sizeof(Dataset::value_type) / 1024, generation_timer.Peek());
 
-    private:
-        void run_kernel_(std::stop_token in_stop_token) {
-            while(auto task = p_pool_->get_task(in_stop_token)) {
-                task();
-            }
-        }
+    const auto locality = numa::report_locality(worker_slices(data), placement.aff);
+    if(locality.available)
+    {
+        const size_t known = locality.local_pages + locality.remote_pages;
+        std::cout << std::format("Worker slices: {} local / {} remote pages ({:.1f}% local), {} not resident\n",
+            locality.local_pages, locality.remote_pages, known ? 100. * double(locality.local_pages) / double(known) : 0., locality.unknown_pages);
+    }
+    else
+    {
+        std::cout << "Worker slices: locality unknown, it needs Linux and pinned workers (--affinity)\n";
+    }
 
-        thread_pool* p_pool_;
-        std::jthread thread_;
-    };
+    return it->second(data, settings);
+}
 
-    task get_task(std::stop_token& in_stop_token) {
-        task task;
-        std::unique_lock ulock{task_queue_mutex_};
-        cvar_queue_task_.wait(ulock, in_stop_token, [this]{return !tasks_.empty();});
+int main(int argc, char* argv[]) {
+    using namespace std::chrono_literals;
 
-        if(!in_stop_token.stop_requested()) {
-            task = std::move(tasks_.front());
-            tasks_.pop_front();
+    popl::OptionParser op("Allowed options");
+    const auto help_option = op.add<popl::Switch>("h", "help", "produce help message");
+    const auto experiment_option = op.add<popl::Value<std::string>>("e", "experiment", "run a chunk experiment: pre, que, atq, pld, hyb, spl, ing, or locks to run que with every lock");
+    const auto dataset_option = op.add<popl::Value<std::string>>("d", "dataset", "dataset for the experiment: random, evenly or stacked", "random");
+    const auto affinity_option = op.add<popl::Value<std::string>>("a", "affinity", "worker placement: none, compact, scatter, cores or a cpu list like 0,2,4-7", "none");
+    const auto placement_option = op.add<popl::Value<std::string>>("p", "placement", "dataset page placement: main, first-touch or bind", "main");
+    const auto claim_option = op.add<popl::Value<std::string>>("c", "claim", "how atq workers claim tasks: per-item, static, dynamic or guided", "per-item");
+    const auto block_option = op.add<popl::Value<size_t>>("b", "block", "claim block size for static and dynamic, smallest block for guided", 64);
+    const auto order_option = op.add<popl::Value<std::string>>("o", "order", "memory order of atq's claim counter: relaxed, acq-rel or seq-cst", "seq-cst");
+    const auto window_option = op.add<popl::Value<size_t>>("w", "window", "pipeline pre, que and atq over this many chunks instead of a barrier per chunk, 0 to keep the barrier", 0);
+    const auto barrier_option = op.add<popl::Value<std::string>>("s", "sync", "end of chunk barrier for pre, que, atq and hyb: condvar, atomic or std", "condvar");
+    const auto wake_option = op.add<popl::Value<std::string>>("k", "wake", "how pre, que, atq and hyb workers are woken per chunk: condvar or epoch", "condvar");
+    const auto spin_option = op.add<popl::Value<unsigned>>("", "spin", "microseconds an epoch worker polls before it sleeps", 0);
+    const auto partition_option = op.add<popl::Value<std::string>>("", "partition", "how pre cuts chunks between its workers: count or cost", "count");
+    const auto lock_option = op.add<popl::Value<std::string>>("", "lock", "lock que's workers take per task: mutex, ttas, ticket, mcs or futex", "mutex");
+    const auto producers_option = op.add<popl::Value<size_t>>("", "producers", "threads filling ing's ring while the workers drain it", 1);
+    const auto ring_option = op.add<popl::Value<size_t>>("", "ring", "capacity of ing's ring in tasks, rounded up to a power of two", 4096);
+    const auto stream_option = op.add<popl::Value<size_t>>("", "stream", "generate chunks while the engine runs, into this many reusable chunk buffers; 0 generates the whole dataset up front", 0);
+    const auto seed_option = op.add<popl::Value<uint64_t>>("", "seed", "dataset seed; a seed gives the same tasks on every machine and thread count", DEFAULT_SEED);
+    const auto gen_threads_option = op.add<popl::Value<size_t>>("", "gen-threads", "threads generating the dataset, 0 for one per physical core", 0);
+    const auto layout_option = op.add<popl::Value<std::string>>("", "layout", "task data layout: aos, or soa for pre and pld", "aos");
+    const auto kernel_option = op.add<popl::Value<std::string>>("", "kernel", "how the SoA layout and spl's light lane process tasks: scalar, batches through auto, sse2, avx2 or avx512, or fast for libm free approximations", "scalar");
+    const auto validate_option = op.add<popl::Switch>("", "validate-kernel", "run every supported batch kernel on every dataset and count the tasks it disagrees with the scalar path on");
+    const auto bench_process_option = op.add<popl::Switch>("", "bench-process", "time Task::process against its unrolled instantiations on every dataset");
+    const auto save_option = op.add<popl::Value<std::string>>("", "save", "generate the dataset chosen with -d and --seed, write it to this file and exit");
+    const auto load_option = op.add<popl::Value<std::string>>("", "load", "map the dataset from a file written with --save instead of generating it; -d and --seed are taken from the file");
+    const auto topology_option = op.add<popl::Switch>("t", "topology", "print the detected cpu topology");
+    const auto litmus_option = op.add<popl::Switch>("l", "litmus", "run atq with every claim order on every dataset and check the results are identical");
+    op.parse(argc, argv);
 
-            if(tasks_.empty()) {
-                cvar_all_done_.notify_all();
-            }
-        }
-        return task;
+    if(help_option->is_set())
+    {
+        std::cout << op << "\n";
+        return 0;
     }
 
-    std::mutex task_queue_mutex_;
-    std::condition_variable_any cvar_queue_task_;
-    std::condition_variable cvar_all_done_;
-    std::deque<task> tasks_;
-    std::vector<worker> workers_;
-};
-
-} // namespace tk
+    if(topology_option->is_set())
+    {
+        const auto& topology = topo::cpu_topology::get();
+        std::cout << std::format("{} package(s), {} numa node(s), {} physical core(s), {} logical cpu(s)\n",
+            topology.package_count(), topology.node_count(), topology.physical_core_count(), topology.logical_count());
+        for(const auto& cpu : topology.cpus())
+        {
+            std::cout << std::format("  cpu {:>3}: package {} core {} node {}\n", cpu.id, cpu.package, cpu.core, cpu.node);
+        }
+        return 0;
+    }
 
-int main(int argc, char* argv[]) {
-    using namespace std::chrono_literals;
+    const auto affinity = topo::parse_affinity(affinity_option->value());
+    if(experiment_option->is_set() || litmus_option->is_set() || validate_option->is_set() || bench_process_option->is_set() || save_option->is_set())
+    {
+        const numa::placement placement{ numa::parse_allocation_mode(placement_option->value()), affinity };
+        const experiment_settings settings
+        {
+            .aff = affinity,
+            .claim = parse_claim_policy(claim_option->value()),
+            .claim_block = block_option->value(),
+            .claim_order = parse_claim_order(order_option->value()),
+            .pipeline_window = window_option->value(),
+            .barrier = parse_barrier_kind(barrier_option->value()),
+            .wake = parse_wake_mode(wake_option->value()),
+            .wake_spin = std::chrono::microseconds{spin_option->value()},
+            .partition = parse_partition_mode(partition_option->value()),
+            .lock = parse_lock_kind(lock_option->value()),
+            .producer_count = producers_option->value(),
+            .ring_capacity = ring_option->value(),
+            .stream_depth = stream_option->value(),
+            .seed = seed_option->value(),
+            .generation_threads = gen_threads_option->value(),
+            .layout = parse_task_layout(layout_option->value()),
+            .kernel = parse_simd_level(kernel_option->value())
+        };
+        if(litmus_option->is_set())
+        {
+            return atq::do_Litmus(placement, settings);
+        }
+        if(validate_option->is_set())
+        {
+            return simd::do_validation(placement, settings.seed);
+        }
+        if(bench_process_option->is_set())
+        {
+            return bench::do_process_benchmark(placement, settings.seed);
+        }
+        if(save_option->is_set())
+        {
+            return dsf::do_save(save_option->value(), parse_dataset_type(dataset_option->value()), placement, settings.seed, settings.generation_threads);
+        }
+        return run_experiment(experiment_option->value(), parse_dataset_type(dataset_option->value()), placement, settings, load_option->is_set() ? load_option->value() : std::string{});
+    }
 
-    tk::thread_pool pool{4};
+    tk::thread_pool pool{topo::default_thread_count(), {}, affinity};
     const auto spitt = [](int milisecond)
     {
         if(milisecond && milisecond % 100 == 0)
@@ -122,9 +228,7 @@ int main(int argc, char* argv[]) {
         return ss.str();
     };
 
-    auto futures = vi::iota(0, 39) |
-        vi::transform([&](int i){return pool.run(spitt, i*25);}) |
-            rn::to<std::vector>();
+    auto futures = pool.run_batch(spitt, vi::iota(0, 39) | vi::transform([](int i){return i*25;}));
 
     for(auto& future : futures)
     {
@@ -146,5 +250,9 @@ int main(int argc, char* argv[]) {
 
     std:: cout << "Result: " << future.get() << "\n";
 
+    const auto idle = pool.get_idle_stats();
+    std::cout << std::format("Wake-ups spin/yield/park: {}/{}/{}, wake latency mean {} max {} (parked mean {})\n",
+        idle.spin_wakeups, idle.yield_wakeups, idle.park_wakeups, idle.mean_wake_latency, idle.max_wake_latency, idle.mean_park_wake_latency);
+
     return 0;
 }
\ No newline at end of file
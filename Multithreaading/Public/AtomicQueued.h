@@ -2,62 +2,100 @@
 #include <iostream>
 #include <thread>
 #include <mutex>
+#include <optional>
 #include <span>
 #include <format>
 #include <atomic>
+#include <algorithm>
+#include <array>
 #include "Constants.h"
 #include "Task.h"
 #include "Timing.h"
+#include "Settings.h"
+#include "Barrier.h"
+#include "Pipeline.h"
+#include "Stream.h"
 #include "../include/MyTimer.h"
 #include "Logging.h"
 
 namespace atq
 {
-    // Interface for the main thread
+    // Everything a worker writes per task or per block, on a cache line of its own unless PACKED_LAYOUT
+    struct alignas(HOT_FIELD_ALIGNMENT) WorkerTally
+    {
+        unsigned int accumulation = 0;
+        size_t num_heavy_items_processed = 0;
+        // Next round of static_blocks
+        size_t static_round = 0;
+    };
+
+    // Interface for the main thread; ClaimOrder is the ordering of every fetch_add on the claim counter. Claims only hand
+    // out indices, the tasks themselves are published by the worker wake-up, so even relaxed is enough
+    template<std::memory_order ClaimOrder = std::memory_order_seq_cst>
     class MasterControl
     {
     public:
-        MasterControl()
+        MasterControl(claim_policy claim = claim_policy::per_item, size_t claim_block = 1, barrier_kind barrier = barrier_kind::condvar)
             :
-            _lk{_mtx},
-            _done_count{0}
+            _completion{barrier, WORKER_COUNT},
+            _claim{claim},
+            _claim_block{std::max<size_t>(claim_block, 1)}
         {}
     
         void signal_Done()
         {
-            bool needs_notification = false;
-            {
-                std::lock_guard lk{_mtx};
-                LOG(LogMasterControl, Info, "Work completed");
-                ++_done_count;
-
-                if(_done_count == WORKER_COUNT)
-                {
-                    LOG(LogMasterControl, Info, "All work is done");
-                    needs_notification = true;
-                }
-            }
-            if(needs_notification)
-                _cv.notify_one();
+            LOG(LogMasterControl, Info, "Work completed");
+            _completion.arrive();
         }
     
-        void wait_For_All_Done()
+        // Returns the synchronisation overhead of the chunk
+        float wait_For_All_Done()
         {
             LOG(LogMasterControl, Info, "Waiting for all other to be done.....");
-            _cv.wait(_lk, [this]{return _done_count == WORKER_COUNT;});
-
-            _done_count = 0;
+            return _completion.wait();
         }
 
         void set_Chunk(std::span<const Task> chunk)
         {
             _idx = 0;
+            _limit = CHUNK_SIZE;
+            _reset_Static_Rounds();
             _current_chunk = chunk;
         }
 
+        // Pipelined runs: the counter runs over every chunk back to back, the window keeps workers within depth chunks of the oldest unfinished one
+        void set_Pipeline(std::span<const Dataset::value_type> chunks, size_t depth)
+        {
+            _idx = 0;
+            _limit = chunks.size() * CHUNK_SIZE;
+            _reset_Static_Rounds();
+            _chunks = chunks;
+            _p_window = std::make_unique<pipeline::window>(chunks.size(), depth, CHUNK_SIZE);
+        }
+
+        bool is_Pipelined() const
+        {
+            return _p_window != nullptr;
+        }
+
+        pipeline::window& get_Window()
+        {
+            return *_p_window;
+        }
+
+        std::span<const Dataset::value_type> get_Chunks() const
+        {
+            return _chunks;
+        }
+
+        WorkerTally& get_Tally(size_t worker_index)
+        {
+            return _tallies[worker_index];
+        }
+
         /*__declspec(noinline)*/ const Task* get_Task()
         {
-            const auto i = _idx.fetch_add(1, std::memory_order_seq_cst);
+            const auto i = _idx.fetch_add(1, ClaimOrder);
             
             if(i >= CHUNK_SIZE)
             {
@@ -66,50 +104,115 @@ namespace atq
             
             return &_current_chunk[i];
         }
+
+        // Next run of tasks for the given worker, empty once the chunk is drained
+        std::span<const Task> get_Block(size_t worker_index)
+        {
+            if(_claim == claim_policy::per_item)
+            {
+                if(const Task* p_task = get_Task())
+                    return {p_task, 1};
+                return {};
+            }
+
+            const auto [begin, end] = get_Range(worker_index);
+            return _current_chunk.subspan(begin, end - begin);
+        }
+
+        // Next [begin, end) of the index space for the given worker, empty once it is drained; the index space is
+        // the current chunk, or every chunk back to back when pipelined
+        std::pair<size_t, size_t> get_Range(size_t worker_index)
+        {
+            size_t begin = 0;
+            size_t size = _claim_block;
+            switch (_claim)
+            {
+            case claim_policy::per_item:
+                begin = _idx.fetch_add(1, ClaimOrder);
+                size = 1;
+                break;
+            case claim_policy::static_blocks:
+                // Round robin over the workers, each worker only ever touches its own round counter
+                begin = (_tallies[worker_index].static_round++ * WORKER_COUNT + worker_index) * _claim_block;
+                break;
+            case claim_policy::dynamic:
+                begin = _idx.fetch_add(_claim_block, ClaimOrder);
+                break;
+            case claim_policy::guided:
+            {
+                // Sized from a possibly stale look at the counter, so claiming stays a single fetch_add;
+                // blocks shrink towards the end of whichever chunk the counter is in
+                const size_t seen = _idx.load(std::memory_order_relaxed);
+                const size_t remaining = seen < _limit ? CHUNK_SIZE - seen % CHUNK_SIZE : 0;
+                size = std::max(remaining / (2 * WORKER_COUNT), _claim_block);
+                begin = _idx.fetch_add(size, ClaimOrder);
+                break;
+            }
+            }
+
+            if(begin >= _limit)
+            {
+                return {_limit, _limit};
+            }
+            return {begin, std::min(begin + size, _limit)};
+        }
     private:
-        std::condition_variable _cv;
-        std::mutex _mtx;
-        std::unique_lock<std::mutex> _lk;
+        void _reset_Static_Rounds()
+        {
+            for(auto& tally : _tallies)
+            {
+                tally.static_round = 0;
+            }
+        }
+
+        bar::completion _completion;
+        // Read mostly
         std::span<const Task> _current_chunk;
-        // shared memory
-        int _done_count;
-        std::atomic<size_t> _idx = 0;
+        std::span<const Dataset::value_type> _chunks;
+        std::unique_ptr<pipeline::window> _p_window;
+        size_t _limit = CHUNK_SIZE;
+        const claim_policy _claim;
+        const size_t _claim_block;
+        // shared memory, hammered by every claim so it gets a line of its own unless PACKED_LAYOUT
+        alignas(HOT_FIELD_ALIGNMENT) std::atomic<size_t> _idx = 0;
+        std::array<WorkerTally, WORKER_COUNT> _tallies;
     };
 
     // Interface for a seaprate thread (joins automatically)
+    template<std::memory_order ClaimOrder = std::memory_order_seq_cst>
     class Worker
     {
     public:
-        Worker(const std::shared_ptr<MasterControl>& p_Mctrl)
+        Worker(const std::shared_ptr<MasterControl<ClaimOrder>>& p_Mctrl, size_t index, std::optional<unsigned> cpu = {}, wake_mode wake = wake_mode::condvar, std::chrono::microseconds wake_spin = {})
             :
             _p_Mctrl{p_Mctrl},
+            _index{index},
+            _tally{p_Mctrl->get_Tally(index)},
+            _cpu{cpu},
+            _doorbell{wake, wake_spin},
             _thread{&Worker::_run, this}
         {
         }
 
         void start_Work()
         {
+            _doorbell.ring([&]
             {
-                std::lock_guard lk{_mtx};
                 _b_working = true;
-            }
-            _cv.notify_one();
-            
+            });
         }
         void kill()
         {
+            _doorbell.ring([&]
             {
-                std::lock_guard lk{_mtx};
                 LOG(LogWorker, Info, "Killing Worker...");
                 _b_dying = true;
-            }
-            
-            _cv.notify_one();
+            });
         }
 
         unsigned int get_Result() const
         {
-            return _accumulation;
+            return _tally.accumulation;
         }
 
         float get_Job_Work_Time() const
@@ -119,7 +222,17 @@ namespace atq
 
         size_t get_Num_Heavy_Items_Processed() const
         {
-            return _num_heavy_items_processed;
+            return _tally.num_heavy_items_processed;
+        }
+
+        const std::vector<pipeline::chunk_span>& get_Spans() const
+        {
+            return _spans;
+        }
+
+        bar::clock::time_point get_Start_Time() const
+        {
+            return _start_time;
         }
 
         ~Worker()
@@ -130,32 +243,73 @@ namespace atq
     private:
         void _process_Data()
         {
-            _num_heavy_items_processed = 0;
+            _tally.num_heavy_items_processed = 0;
 
             LOG(LogWorker, Info, "Process data for Worker");
-            while(auto p_task = _p_Mctrl->get_Task())
+            for(auto block = _p_Mctrl->get_Block(_index); !block.empty(); block = _p_Mctrl->get_Block(_index))
             {
-                _accumulation += p_task->process();
-                _num_heavy_items_processed += p_task->_b_heavy ? 1 : 0;
+                for(const auto& task : block)
+                {
+                    _tally.accumulation += task.process();
+                    _tally.num_heavy_items_processed += task._b_heavy ? 1 : 0;
+                }
             }
             
-            LOG(LogWorker, Info, "Processed data: {} for Worker", _accumulation);
+            LOG(LogWorker, Info, "Processed data: {} for Worker", _tally.accumulation);
+        }
+
+        void _process_Pipeline()
+        {
+            LOG(LogWorker, Info, "Process pipeline for Worker");
+            _spans.clear();
+            pipeline::cursor cursor{_p_Mctrl->get_Window(), _spans};
+            const auto chunks = _p_Mctrl->get_Chunks();
+            while(true)
+            {
+                auto [begin, end] = _p_Mctrl->get_Range(_index);
+                if(begin >= end)
+                    break;
+
+                // A claimed range may straddle chunks, each piece goes through the window on its own
+                while(begin < end)
+                {
+                    const size_t chunk = begin / CHUNK_SIZE;
+                    const size_t piece_end = std::min(end, (chunk + 1) * CHUNK_SIZE);
+                    cursor.enter(chunk);
+                    size_t heavy = 0;
+                    for(const auto& task : std::span{&chunks[chunk][begin % CHUNK_SIZE], piece_end - begin})
+                    {
+                        _tally.accumulation += task.process();
+                        heavy += task._b_heavy ? 1 : 0;
+                    }
+                    cursor.add(piece_end - begin, heavy);
+                    begin = piece_end;
+                }
+            }
+            cursor.leave();
+            LOG(LogWorker, Info, "Processed data: {} for Worker", _tally.accumulation);
         }
 
         void _run()
         {
-            std::unique_lock lk{_mtx};
+            if(_cpu)
+                topo::pin_current_thread(*_cpu);
+
             while (true)
             {
                 MyTimer timer;
-                _cv.wait(lk, [this] { return _b_working || _b_dying; });
+                _doorbell.wait([this] { return _b_working || _b_dying; });
 
                 if (_b_dying)
                     break;
 
+                _start_time = bar::clock::now();
                 timer.Mark();
 
-                _process_Data();
+                if (_p_Mctrl->is_Pipelined())
+                    _process_Pipeline();
+                else
+                    _process_Data();
 
                 _work_time = timer.Peek();
 
@@ -164,65 +318,103 @@ namespace atq
             }
         }
 
-        std::shared_ptr<MasterControl> _p_Mctrl;
-        std::jthread _thread;
-        std::condition_variable _cv;
-        std::mutex _mtx;
+        std::shared_ptr<MasterControl<ClaimOrder>> _p_Mctrl;
+        size_t _index;
+        // Lives in the MasterControl, next to the other workers' tallies
+        WorkerTally& _tally;
+        std::optional<unsigned> _cpu;
+        bar::doorbell _doorbell;
 
         // shared memoru
-        unsigned int _accumulation = 0;
         bool _b_dying = false;
         bool _b_working = false;
         float _work_time = -1.f;
-        size_t _num_heavy_items_processed = 0;
+        std::vector<pipeline::chunk_span> _spans;
+        bar::clock::time_point _start_time;
+        // Declared last: the thread starts in the constructor and uses every member above
+        std::jthread _thread;
     };
 
 
-    int do_Experiment(Dataset chunks)
+    // What one run over the dataset produced
+    struct RunResult
+    {
+        unsigned int result;
+        float time_taken;
+        std::vector<chunk_timing_info> timings;
+    };
+
+    template<std::memory_order ClaimOrder>
+    RunResult run_Chunks(stm::chunk_source chunks, const experiment_settings& settings)
     {
         LOG(LogTemp, Info, "Starting experiment");
             
         MyTimer total_timer;
         total_timer.Mark();
 
-       auto sp_mctrl = std::make_shared<MasterControl>();
+       auto sp_mctrl = std::make_shared<MasterControl<ClaimOrder>>(settings.claim, settings.claim_block, settings.barrier);
         
         if(!sp_mctrl)
             throw std::exception("Failed to create MasterControl");
 
         LOG(LogTemp, Info, "Allocate p_workers");
         
-        std::vector<std::unique_ptr<Worker>> p_workers;
+        std::vector<std::unique_ptr<Worker<ClaimOrder>>> p_workers;
+        const auto cpus = topo::cpu_topology::get().plan(settings.aff, WORKER_COUNT);
         for(size_t j = 0; j < WORKER_COUNT; j++)
         {
-            p_workers.push_back(std::make_unique<Worker>(sp_mctrl));
+            p_workers.push_back(std::make_unique<Worker<ClaimOrder>>(sp_mctrl, j, cpus[j], settings.wake, settings.wake_spin));
         }
 
         std::vector<chunk_timing_info> timings;
         timings.reserve(CHUNK_COUNT);
         
-        MyTimer chunk_timer;
-        for(const auto& chunk : chunks)
+        if(settings.pipeline_window > 0)
         {
-            chunk_timer.Mark();
-            sp_mctrl->set_Chunk(chunk);
+            // One wake-up and one wait for the whole run, chunk timings are rebuilt from what the workers recorded
+            const auto start = pipeline::clock::now();
+            sp_mctrl->set_Pipeline(chunks.dataset(), settings.pipeline_window);
             for(auto& p_worker : p_workers)
             {
                 p_worker->start_Work();
             }
             sp_mctrl->wait_For_All_Done();
-            
-            // Report timing for threads
-            const auto chunk_time = chunk_timer.Peek();
-            timings.push_back
-            (
-              {}  
-            );
-            for(size_t i = 0; i < WORKER_COUNT; i++)
-            {
-                timings.back().number_of_heavy_items_per_thread[i] = p_workers[i]->get_Num_Heavy_Items_Processed();
-                timings.back().time_spent_working_per_thread[i] = p_workers[i]->get_Job_Work_Time();
-                timings.back().total_chunk_time = chunk_time;
+
+            std::vector<std::vector<pipeline::chunk_span>> spans;
+            for(const auto& p_worker : p_workers)
+            {
+                spans.push_back(p_worker->get_Spans());
+            }
+            timings = pipeline::to_chunk_timings(start, chunks.size(), spans);
+        }
+        else
+        {
+            MyTimer chunk_timer;
+            for(const auto& chunk : chunks)
+            {
+                chunk_timer.Mark();
+                sp_mctrl->set_Chunk(chunk);
+                for(auto& p_worker : p_workers)
+                {
+                    p_worker->start_Work();
+                }
+                const float sync_overhead = sp_mctrl->wait_For_All_Done();
+                
+                // Report timing for threads
+                const auto chunk_time = chunk_timer.Peek();
+                timings.push_back
+                (
+                  {}  
+                );
+                for(size_t i = 0; i < WORKER_COUNT; i++)
+                {
+                    timings.back().number_of_heavy_items_per_thread[i] = p_workers[i]->get_Num_Heavy_Items_Processed();
+                    timings.back().time_spent_working_per_thread[i] = p_workers[i]->get_Job_Work_Time();
+                    timings.back().total_chunk_time = chunk_time;
+                }
+                timings.back().sync_overhead = sync_overhead;
+                const auto [it_first, it_last] = std::ranges::minmax_element(p_workers, {}, &Worker<ClaimOrder>::get_Start_Time);
+                timings.back().start_skew = std::chrono::duration<float>((*it_last)->get_Start_Time() - (*it_first)->get_Start_Time()).count();
             }
         }
 
@@ -230,12 +422,38 @@ namespace atq
         
         // Accumlate the overall result.
         unsigned int final_result = 0;
-        LOG_ALWAYS(LogTemp, Info, "Accumulating final result");
+        LOG(LogTemp, Info, "Accumulating final result");
         for(const auto& w : p_workers)
         {
             final_result += w->get_Result();
         }
-        LOG_ALWAYS(LogTemp, Info, "Result is {}\n Time taken: {}", final_result, t);
+
+        return {final_result, t, std::move(timings)};
+    }
+
+    // The run_Chunks instantiation for the claim ordering picked at run time
+    RunResult run_Experiment(stm::chunk_source chunks, const experiment_settings& settings)
+    {
+        switch (settings.claim_order)
+        {
+        case std::memory_order_relaxed:
+            return run_Chunks<std::memory_order_relaxed>(chunks, settings);
+        case std::memory_order_acq_rel:
+            return run_Chunks<std::memory_order_acq_rel>(chunks, settings);
+        case std::memory_order_seq_cst:
+            return run_Chunks<std::memory_order_seq_cst>(chunks, settings);
+        default:
+            throw std::invalid_argument("atq claims with relaxed, acq_rel or seq_cst");
+        }
+    }
+
+    int do_Experiment(stm::chunk_source chunks, const experiment_settings& settings = {})
+    {
+        const auto run = run_Experiment(chunks, settings);
+        LOG_ALWAYS(LogTemp, Info, "Result is {}\n Time taken: {}\n Layout: {}\n Claim order: {}",
+            run.result, run.time_taken, PACKED_LAYOUT_ENABLED ? "packed" : "cache line isolated", claim_order_name(settings.claim_order));
+        LOG_ALWAYS(LogTemp, Info, "Sync overhead per chunk: {}us, start skew: {}us",
+            mean_per_chunk(run.timings, &chunk_timing_info::sync_overhead) * 1'000'000.f, mean_per_chunk(run.timings, &chunk_timing_info::start_skew) * 1'000'000.f);
 
         
         // Output csv of chunk timings
@@ -243,7 +461,7 @@ namespace atq
 
         if constexpr (CHUNK_MEASUREMENT_ENABLED)
         {
-            write_csv(timings);
+            write_csv(run.timings);
         }
 
         
@@ -251,4 +469,38 @@ namespace atq
 
         return 0;
     }
+
+    // Runs every claim ordering on every dataset type; the orderings may only differ in speed, never in the result
+    int do_Litmus(const numa::placement& placement, experiment_settings settings = {})
+    {
+        constexpr std::array orders{std::memory_order_relaxed, std::memory_order_acq_rel, std::memory_order_seq_cst};
+
+        std::cout << std::format("{:<10}", "dataset");
+        for(const auto order : orders)
+        {
+            std::cout << std::format("{:>12}", claim_order_name(order));
+        }
+        std::cout << "   result\n";
+
+        return sweep_dataset_types([&](DatasetType type, const char* name)
+        {
+            const auto chunks = generate_data_sets_by_type(type, placement, settings.seed, settings.generation_threads);
+            std::vector<RunResult> runs;
+            for(const auto order : orders)
+            {
+                settings.claim_order = order;
+                runs.push_back(run_Experiment(chunks, settings));
+            }
+
+            const bool identical = std::ranges::all_of(runs, [&](const RunResult& run){ return run.result == runs.front().result; });
+
+            std::cout << std::format("{:<10}", name);
+            for(const auto& run : runs)
+            {
+                std::cout << std::format("{:>11.4f}s", run.time_taken);
+            }
+            std::cout << std::format("   {} {}\n", runs.front().result, identical ? "identical" : "MISMATCH");
+            return identical;
+        });
+    }
 }
@@ -0,0 +1,203 @@
+﻿#pragma once
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include "Settings.h"
+#include "Spin.h"
+
+namespace bar
+{
+    using clock = std::chrono::steady_clock;
+
+    // The end of chunk barrier of the experiment engines: every worker arrives once per round, the master waits for all
+    // of them. The kind picks the mechanism, so the engines can compare them on the same run
+    class completion
+    {
+    public:
+        completion(barrier_kind kind, size_t worker_count)
+            :
+            kind_{kind},
+            worker_count_{static_cast<uint32_t>(worker_count)},
+            barrier_{static_cast<std::ptrdiff_t>(worker_count) + 1}
+        {}
+
+        void arrive()
+        {
+            stamp_arrival_();
+            switch (kind_)
+            {
+            case barrier_kind::condvar:
+            {
+                bool needs_notification = false;
+                {
+                    std::lock_guard lk{mtx_};
+                    needs_notification = ++done_count_ == worker_count_;
+                }
+                if(needs_notification)
+                    cv_.notify_one();
+                break;
+            }
+            case barrier_kind::atomic_wait:
+                // Only the last one to arrive touches the flag the master sleeps on
+                if(arrived_.fetch_add(1, std::memory_order_acq_rel) + 1 == worker_count_)
+                {
+                    round_done_.store(1, std::memory_order_release);
+                    round_done_.notify_one();
+                }
+                break;
+            case barrier_kind::std_barrier:
+                static_cast<void>(barrier_.arrive());
+                break;
+            }
+        }
+
+        // Returns the synchronisation overhead of the round: seconds from the last arrival until the master is running again
+        float wait()
+        {
+            switch (kind_)
+            {
+            case barrier_kind::condvar:
+            {
+                std::unique_lock lk{mtx_};
+                cv_.wait(lk, [this]{ return done_count_ == worker_count_; });
+                done_count_ = 0;
+                break;
+            }
+            case barrier_kind::atomic_wait:
+                while(round_done_.load(std::memory_order_acquire) == 0)
+                    round_done_.wait(0, std::memory_order_acquire);
+                // Nobody arrives again before the master starts the next round
+                arrived_.store(0, std::memory_order_relaxed);
+                round_done_.store(0, std::memory_order_relaxed);
+                break;
+            case barrier_kind::std_barrier:
+                barrier_.arrive_and_wait();
+                break;
+            }
+
+            const auto woken = clock::now().time_since_epoch().count();
+            const auto last = last_arrival_.exchange(0, std::memory_order_relaxed);
+            return std::chrono::duration<float>(clock::duration{woken - last}).count();
+        }
+
+    private:
+        void stamp_arrival_()
+        {
+            // The arrival itself publishes the stamp to the master, relaxed is enough here
+            const auto now = clock::now().time_since_epoch().count();
+            auto seen = last_arrival_.load(std::memory_order_relaxed);
+            while(seen < now && !last_arrival_.compare_exchange_weak(seen, now, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        const barrier_kind kind_;
+        const uint32_t worker_count_;
+        std::atomic<clock::rep> last_arrival_ = 0;
+
+        // condvar
+        std::mutex mtx_;
+        std::condition_variable cv_;
+        uint32_t done_count_ = 0;
+
+        // atomic_wait, 32 bit so that wait and notify map straight onto a futex
+        std::atomic<uint32_t> arrived_ = 0;
+        std::atomic<uint32_t> round_done_ = 0;
+
+        // std_barrier, the workers and the master
+        std::barrier<> barrier_;
+    };
+
+    // Wakes one worker of the experiment engines for its next chunk. The master changes the worker's state inside ring,
+    // the worker sleeps in wait until that state says there is something to do
+    class doorbell
+    {
+    public:
+        doorbell(wake_mode mode, std::chrono::microseconds spin)
+            :
+            mode_{mode},
+            spin_{spin}
+        {}
+
+        template<typename UpdateType>
+        void ring(UpdateType&& update)
+        {
+            switch (mode_)
+            {
+            case wake_mode::condvar:
+                {
+                    std::lock_guard lk{mtx_};
+                    update();
+                }
+                cv_.notify_one();
+                break;
+            case wake_mode::epoch:
+                // The bump publishes the update, the worker only reads its state once it sees the new epoch
+                update();
+                epoch_.fetch_add(1, std::memory_order_release);
+                epoch_.notify_all();
+                break;
+            }
+        }
+
+        template<typename ReadyType>
+        void wait(ReadyType&& ready)
+        {
+            switch (mode_)
+            {
+            case wake_mode::condvar:
+            {
+                std::unique_lock lk{mtx_};
+                cv_.wait(lk, ready);
+                break;
+            }
+            case wake_mode::epoch:
+                do
+                {
+                    wait_for_epoch_();
+                } while(!ready());
+                break;
+            }
+        }
+
+    private:
+        void wait_for_epoch_()
+        {
+            if(spin_.count() > 0)
+            {
+                // Poll first, the next chunk is usually only a few microseconds away; the clock is checked every 64 pauses
+                const auto deadline = clock::now() + spin_;
+                for(unsigned i = 1; ; i++)
+                {
+                    const auto epoch = epoch_.load(std::memory_order_acquire);
+                    if(epoch != seen_)
+                    {
+                        seen_ = epoch;
+                        return;
+                    }
+                    tk::cpu_relax();
+                    if(i % 64 == 0 && clock::now() >= deadline)
+                        break;
+                }
+            }
+
+            epoch_.wait(seen_, std::memory_order_acquire);
+            seen_ = epoch_.load(std::memory_order_acquire);
+        }
+
+        const wake_mode mode_;
+        const std::chrono::microseconds spin_;
+
+        // condvar
+        std::mutex mtx_;
+        std::condition_variable cv_;
+
+        // epoch, only the worker touches seen_
+        std::atomic<uint32_t> epoch_ = 0;
+        uint32_t seen_ = 0;
+    };
+}
@@ -0,0 +1,45 @@
+﻿#pragma once
+#include <array>
+#include <format>
+#include <iostream>
+#include <utility>
+#include "Task.h"
+#include "../include/MyTimer.h"
+
+namespace bench
+{
+    // One thread through every task of the dataset, returns the sum and the seconds it took
+    template<typename ProcessType>
+    std::pair<unsigned int, float> time_pass(const Dataset& chunks, ProcessType&& process)
+    {
+        MyTimer timer;
+        timer.Mark();
+        unsigned int accumulation = 0;
+        for(const auto& chunk : chunks)
+        {
+            for(const auto& t : chunk)
+            {
+                accumulation += process(t);
+            }
+        }
+        return {accumulation, timer.Peek()};
+    }
+
+    // Task::process with its runtime iteration count against the unrolled instantiations behind process_kernels,
+    // on every dataset; non zero when the two disagree on a result
+    inline int do_process_benchmark(const numa::placement& placement, uint64_t seed = DEFAULT_SEED)
+    {
+        std::cout << std::format("{:<10}{:>12}{:>12}{:>9}   result\n", "dataset", "runtime", "unrolled", "speedup");
+        return sweep_dataset_types([&](DatasetType type, const char* name)
+        {
+            const auto chunks = generate_data_sets_by_type(type, placement, seed);
+            const auto [runtime_result, runtime_time] = time_pass(chunks, [](const Task& t) { return t.process(); });
+            const auto [unrolled_result, unrolled_time] = time_pass(chunks, [](const Task& t) { return t.process_dispatched(); });
+
+            const bool identical = runtime_result == unrolled_result;
+            std::cout << std::format("{:<10}{:>11.4f}s{:>11.4f}s{:>8.2f}x   {} {}\n", name, runtime_time, unrolled_time,
+                unrolled_time > 0.f ? runtime_time / unrolled_time : 0.f, runtime_result, identical ? "identical" : "MISMATCH");
+            return identical;
+        });
+    }
+}
@@ -0,0 +1,177 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace tk {
+
+// Recycles small blocks through per-thread free lists; a thread only touches the shared lists once per batch
+class block_pool {
+public:
+    static constexpr std::array<size_t, 3> size_classes = {64, 128, 256};
+    static constexpr size_t batch_size = 32;
+
+    static void* allocate(size_t bytes) {
+        const auto cls = class_of_(bytes);
+        if(cls == size_classes.size()) {
+            return ::operator new(bytes);
+        }
+
+        auto& list = local_().lists[cls];
+        if(!list.head) {
+            list = shared_().take_batch(cls);
+            if(!list.head) {
+                return ::operator new(size_classes[cls]);
+            }
+        }
+        return list.pop();
+    }
+
+    static void deallocate(void* p, size_t bytes) noexcept {
+        const auto cls = class_of_(bytes);
+        if(cls == size_classes.size()) {
+            ::operator delete(p);
+            return;
+        }
+
+        auto& list = local_().lists[cls];
+        list.push(p);
+        // Keep one batch around locally, hand the surplus back for threads that only allocate
+        if(list.count >= 2 * batch_size) {
+            shared_().give_batch(cls, list.split(batch_size));
+        }
+    }
+
+private:
+    struct free_block {
+        free_block* next;
+    };
+
+    struct free_list {
+        free_block* head = nullptr;
+        size_t count = 0;
+
+        void push(void* p) {
+            head = ::new (p) free_block{head};
+            ++count;
+        }
+
+        void* pop() {
+            auto* p = head;
+            head = head->next;
+            --count;
+            return p;
+        }
+
+        free_list split(size_t n) {
+            free_list out;
+            while(out.count < n && head) {
+                out.push(pop());
+            }
+            return out;
+        }
+
+        void release() {
+            while(head) {
+                ::operator delete(pop());
+            }
+        }
+    };
+
+    struct shared_lists {
+        std::mutex mtx;
+        std::array<std::vector<free_list>, size_classes.size()> batches;
+
+        free_list take_batch(size_t cls) {
+            std::lock_guard lock{mtx};
+            if(batches[cls].empty()) {
+                return {};
+            }
+            auto batch = batches[cls].back();
+            batches[cls].pop_back();
+            return batch;
+        }
+
+        void give_batch(size_t cls, free_list batch) {
+            std::lock_guard lock{mtx};
+            batches[cls].push_back(batch);
+        }
+
+        ~shared_lists() {
+            for(auto& per_class : batches) {
+                for(auto& batch : per_class) {
+                    batch.release();
+                }
+            }
+        }
+    };
+
+    struct local_lists {
+        std::array<free_list, size_classes.size()> lists;
+
+        ~local_lists() {
+            for(size_t cls = 0; cls < lists.size(); cls++) {
+                if(lists[cls].head) {
+                    shared_().give_batch(cls, lists[cls]);
+                }
+            }
+        }
+    };
+
+    static size_t class_of_(size_t bytes) {
+        size_t cls = 0;
+        while(cls < size_classes.size() && bytes > size_classes[cls]) {
+            ++cls;
+        }
+        return cls;
+    }
+
+    static shared_lists& shared_() {
+        static shared_lists lists;
+        return lists;
+    }
+
+    static local_lists& local_() {
+        // Touch the shared lists first so they outlive every thread's cache
+        shared_();
+        thread_local local_lists lists;
+        return lists;
+    }
+};
+
+// Allocator front end for block_pool, used for the future shared states of thread_pool::run
+template<typename T>
+struct pooled_allocator {
+    using value_type = T;
+
+    pooled_allocator() noexcept = default;
+    template<typename U>
+    pooled_allocator(const pooled_allocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if constexpr(alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{alignof(T)}));
+        }
+        else {
+            return static_cast<T*>(block_pool::allocate(n * sizeof(T)));
+        }
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        if constexpr(alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            ::operator delete(p, std::align_val_t{alignof(T)});
+        }
+        else {
+            block_pool::deallocate(p, n * sizeof(T));
+        }
+    }
+
+    template<typename U>
+    bool operator==(const pooled_allocator<U>&) const noexcept {
+        return true;
+    }
+};
+
+} // namespace tk
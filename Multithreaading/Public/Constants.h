@@ -1,4 +1,6 @@
 ﻿#pragma once
+#include <cstddef>
+#include <cstdint>
 
 inline constexpr bool CHUNK_MEASUREMENT_ENABLED = true;
 
@@ -10,6 +12,21 @@ inline constexpr size_t SUBSET_SIZE = CHUNK_SIZE / WORKER_COUNT;
 inline constexpr size_t LIGHT_ITERATIONS = 2;
 inline constexpr size_t HEAVY_ITERATIONS = 20;
 inline constexpr double PROBABILITY_HEAVY = .15;
+inline constexpr size_t PARALLEL_FOR_GRAIN = 250;
+// Dataset seed when none is given
+inline constexpr uint64_t DEFAULT_SEED = 1;
+
+// The hot shared and per worker fields of the engines get a cache line each. Build with PACKED_LAYOUT defined to pack
+// them next to each other instead, and measure what the false sharing costs. Worker objects that are not aligned
+// this way sit next to each other on the heap, so engines tally per task results in locals and store them once per
+// range or chunk
+#ifdef PACKED_LAYOUT
+inline constexpr bool PACKED_LAYOUT_ENABLED = true;
+#else
+inline constexpr bool PACKED_LAYOUT_ENABLED = false;
+#endif
+inline constexpr size_t CACHE_LINE_SIZE = 64;
+inline constexpr size_t HOT_FIELD_ALIGNMENT = PACKED_LAYOUT_ENABLED ? alignof(std::max_align_t) : CACHE_LINE_SIZE;
 
 
 // ensnure the chunk size is a multiple of 4
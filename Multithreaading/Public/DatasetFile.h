@@ -0,0 +1,249 @@
+﻿#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Constants.h"
+#include "Task.h"
+#include "../include/MyTimer.h"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A dataset on disk: one header page, then every chunk's tasks back to back as in-memory Task records (the value, the
+// heavy flag and zeroed padding), so a mapping of the file is the chunks as they are. Written once with save, mapped
+// read-only with mapped_dataset, whose chunks point straight into the page cache
+namespace dsf
+{
+    // Bump on any change to the header or the records; readers reject every other version
+    inline constexpr uint32_t FORMAT_VERSION = 1;
+    inline constexpr std::array<char, 8> MAGIC{'M', 'T', 'D', 'A', 'T', 'A', 'S', 'T'};
+    // Tells a file written on a machine of the other byte order apart
+    inline constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+    // The records start on a page of their own, which keeps them aligned for Task in the mapping
+    inline constexpr size_t DATA_OFFSET = 4096;
+
+    struct file_header
+    {
+        std::array<char, 8> magic = MAGIC;
+        uint32_t version = FORMAT_VERSION;
+        uint32_t byte_order = BYTE_ORDER_MARK;
+        uint64_t data_offset = DATA_OFFSET;
+        uint64_t chunk_size = CHUNK_SIZE;
+        uint64_t chunk_count = 0;
+        uint32_t task_bytes = sizeof(Task);
+        uint32_t val_offset = offsetof(Task, val);
+        uint32_t heavy_offset = offsetof(Task, _b_heavy);
+
+        // What generated the tasks
+        uint32_t dataset_type = 0;
+        uint64_t seed = DEFAULT_SEED;
+        double probability_heavy = PROBABILITY_HEAVY;
+    };
+
+    static_assert(sizeof(file_header) <= DATA_OFFSET);
+    static_assert(DATA_OFFSET % alignof(Task) == 0);
+    static_assert(sizeof(Dataset::value_type) == CHUNK_SIZE * sizeof(Task), "chunks are read back as plain Task arrays");
+
+    inline void save(const std::string& path, const Dataset& chunks, DatasetType type, uint64_t seed)
+    {
+        std::ofstream file{ path, std::ios_base::binary | std::ios_base::trunc };
+        if(!file)
+            throw std::runtime_error("Cannot create dataset file " + path);
+
+        file_header header;
+        header.chunk_count = chunks.size();
+        header.dataset_type = static_cast<uint32_t>(type);
+        header.seed = seed;
+
+        std::vector<std::byte> page(DATA_OFFSET);
+        std::memcpy(page.data(), &header, sizeof(header));
+        file.write(reinterpret_cast<const char*>(page.data()), static_cast<std::streamsize>(page.size()));
+
+        // Field by field into a zeroed record, so the padding on disk is defined
+        std::vector<std::byte> records(sizeof(Dataset::value_type));
+        for(const auto& chunk : chunks)
+        {
+            std::ranges::fill(records, std::byte{0});
+            for(size_t i = 0; i < chunk.size(); i++)
+            {
+                std::byte* p_record = records.data() + i * sizeof(Task);
+                std::memcpy(p_record + offsetof(Task, val), &chunk[i].val, sizeof(chunk[i].val));
+                std::memcpy(p_record + offsetof(Task, _b_heavy), &chunk[i]._b_heavy, sizeof(chunk[i]._b_heavy));
+            }
+            file.write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size()));
+        }
+
+        if(!file.flush())
+            throw std::runtime_error("Cannot write dataset file " + path);
+    }
+
+    // A dataset file mapped read-only; pages are read in as the engines first touch them
+    class mapped_dataset
+    {
+    public:
+        explicit mapped_dataset(const std::string& path)
+        {
+            map_(path);
+            try
+            {
+                validate_(path);
+            }
+            catch(...)
+            {
+                unmap_();
+                throw;
+            }
+        }
+
+        mapped_dataset(const mapped_dataset&) = delete;
+        mapped_dataset& operator=(const mapped_dataset&) = delete;
+
+        ~mapped_dataset()
+        {
+            unmap_();
+        }
+
+        const file_header& header() const
+        {
+            return *reinterpret_cast<const file_header*>(p_base_);
+        }
+
+        DatasetType type() const
+        {
+            return static_cast<DatasetType>(header().dataset_type);
+        }
+
+        size_t size() const
+        {
+            return header().chunk_count;
+        }
+
+        size_t file_bytes() const
+        {
+            return file_bytes_;
+        }
+
+        std::span<const Task, CHUNK_SIZE> chunk(size_t index) const
+        {
+            return std::span<const Task, CHUNK_SIZE>{ &chunk_array(index)[0], CHUNK_SIZE };
+        }
+
+        // The chunk in the shape the engines iterate; the records are laid out exactly as one
+        const Dataset::value_type& chunk_array(size_t index) const
+        {
+            return reinterpret_cast<const Dataset::value_type*>(p_base_ + header().data_offset)[index];
+        }
+
+    private:
+        void validate_(const std::string& path) const
+        {
+            if(file_bytes_ < sizeof(file_header))
+                throw std::runtime_error(path + " is too small to be a dataset file");
+
+            const auto& h = header();
+            if(h.magic != MAGIC)
+                throw std::runtime_error(path + " is not a dataset file");
+            if(h.version != FORMAT_VERSION)
+                throw std::runtime_error(std::format("{} has format version {}, this build reads version {}", path, h.version, FORMAT_VERSION));
+            if(h.byte_order != BYTE_ORDER_MARK)
+                throw std::runtime_error(path + " was written on a machine of the other byte order");
+            if(h.chunk_size != CHUNK_SIZE)
+                throw std::runtime_error(std::format("{} has chunks of {} tasks, this build uses {}", path, h.chunk_size, CHUNK_SIZE));
+            if(h.task_bytes != sizeof(Task) || h.val_offset != offsetof(Task, val) || h.heavy_offset != offsetof(Task, _b_heavy))
+                throw std::runtime_error(path + " has a Task record layout that differs from this build's");
+            if(h.dataset_type >= ALL_DATASET_TYPES.size())
+                throw std::runtime_error(path + " has an unknown dataset type");
+            if(h.data_offset % alignof(Task) != 0 || h.data_offset < sizeof(file_header) || h.data_offset > file_bytes_
+                || h.chunk_count > (file_bytes_ - h.data_offset) / sizeof(Dataset::value_type))
+                throw std::runtime_error(path + " is truncated or its header is damaged");
+        }
+
+#if defined(_WIN32)
+        void map_(const std::string& path)
+        {
+            const HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if(file == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Cannot open dataset file " + path);
+
+            LARGE_INTEGER size{};
+            GetFileSizeEx(file, &size);
+            file_bytes_ = static_cast<size_t>(size.QuadPart);
+            const HANDLE mapping = file_bytes_ ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+            CloseHandle(file);
+            if(!mapping)
+                throw std::runtime_error("Cannot map dataset file " + path);
+
+            // The view keeps the mapping alive on its own
+            p_base_ = static_cast<const std::byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            CloseHandle(mapping);
+            if(!p_base_)
+                throw std::runtime_error("Cannot map dataset file " + path);
+        }
+
+        void unmap_()
+        {
+            if(p_base_)
+                UnmapViewOfFile(p_base_);
+            p_base_ = nullptr;
+        }
+#else
+        void map_(const std::string& path)
+        {
+            const int fd = open(path.c_str(), O_RDONLY);
+            if(fd < 0)
+                throw std::runtime_error("Cannot open dataset file " + path);
+
+            struct stat info{};
+            fstat(fd, &info);
+            file_bytes_ = static_cast<size_t>(info.st_size);
+            void* p_mapping = file_bytes_ ? mmap(nullptr, file_bytes_, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            // The mapping keeps the file alive on its own
+            close(fd);
+            if(p_mapping == MAP_FAILED)
+                throw std::runtime_error("Cannot map dataset file " + path);
+            p_base_ = static_cast<const std::byte*>(p_mapping);
+        }
+
+        void unmap_()
+        {
+            if(p_base_)
+                munmap(const_cast<std::byte*>(p_base_), file_bytes_);
+            p_base_ = nullptr;
+        }
+#endif
+
+        const std::byte* p_base_ = nullptr;
+        size_t file_bytes_ = 0;
+    };
+
+    // Generates the dataset of the type and seed and writes it to path
+    inline int do_save(const std::string& path, DatasetType type, const numa::placement& placement, uint64_t seed, size_t thread_count)
+    {
+        MyTimer timer;
+        timer.Mark();
+        const auto chunks = generate_data_sets_by_type(type, placement, seed, thread_count);
+        const float generation_time = timer.Mark();
+        save(path, chunks, type, seed);
+        std::cout << std::format("Dataset: {} KB generated in {:.4f}s, written to {} in {:.4f}s\n",
+            chunks.size() * sizeof(Dataset::value_type) / 1024, generation_time, path, timer.Peek());
+        return 0;
+    }
+}
@@ -0,0 +1,339 @@
+﻿#pragma once
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <format>
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include "Constants.h"
+#include "Task.h"
+#include "Timing.h"
+#include "Settings.h"
+#include "Barrier.h"
+#include "Stream.h"
+#include "../include/MyTimer.h"
+#include "Logging.h"
+
+namespace hyb
+{
+    // Interface for the main thread
+    class master_control
+    {
+    public:
+        master_control(barrier_kind barrier = barrier_kind::condvar)
+            :
+            completion_{barrier, WORKER_COUNT}
+        {}
+    
+        void signal_done()
+        {
+            LOG(LogMasterControl, Info, "Work completed");
+            completion_.arrive();
+        }
+    
+        // Returns the synchronisation overhead of the chunk
+        float wait_for_all_done()
+        {
+            LOG(LogMasterControl, Info, "Waiting for all other to be done.....");
+            return completion_.wait();
+        }
+
+        // Every worker starts on its own contiguous SUBSET_SIZE range, exactly like pre
+        void set_chunk(std::span<const Task> chunk)
+        {
+            chunk_ = chunk;
+            for(size_t i = 0; i < WORKER_COUNT; i++)
+            {
+                ranges_[i].packed.store(pack_(i * SUBSET_SIZE, (i + 1) * SUBSET_SIZE), std::memory_order_relaxed);
+            }
+        }
+
+        // Front of the worker's own range; only the owner claims, so the fetch_add is uncontended unless a thief steps in
+        const Task* claim(size_t worker_index)
+        {
+            const auto range = ranges_[worker_index].packed.fetch_add(1, std::memory_order_acq_rel);
+            if(begin_(range) >= end_(range))
+            {
+                return nullptr;
+            }
+            return &chunk_[begin_(range)];
+        }
+
+        // Takes the upper half of the largest range left among the peers and makes it the thief's own
+        bool steal(size_t thief_index)
+        {
+            while(true)
+            {
+                size_t victim = WORKER_COUNT;
+                uint64_t seen = 0;
+                size_t largest = 1;
+                for(size_t i = 0; i < WORKER_COUNT; i++)
+                {
+                    if(i == thief_index)
+                        continue;
+                    const auto range = ranges_[i].packed.load(std::memory_order_acquire);
+                    if(remaining_(range) > largest)
+                    {
+                        victim = i;
+                        seen = range;
+                        largest = remaining_(range);
+                    }
+                }
+
+                // Single leftover items are not worth a steal, their owner is about to take them
+                if(victim == WORKER_COUNT)
+                    return false;
+
+                const size_t mid = begin_(seen) + largest / 2;
+                if(ranges_[victim].packed.compare_exchange_strong(seen, pack_(begin_(seen), mid), std::memory_order_acq_rel))
+                {
+                    ranges_[thief_index].packed.store(pack_(mid, end_(seen)), std::memory_order_release);
+                    return true;
+                }
+            }
+        }
+
+    private:
+        // [begin, end) in one word so that owner and thieves agree on it with a single atomic operation;
+        // begin sits in the low half so the owner can claim with a plain fetch_add
+        static uint64_t pack_(size_t begin, size_t end)
+        {
+            return static_cast<uint64_t>(end) << 32 | static_cast<uint64_t>(begin);
+        }
+
+        static size_t begin_(uint64_t range)
+        {
+            return static_cast<size_t>(range & 0xFFFF'FFFF);
+        }
+
+        static size_t end_(uint64_t range)
+        {
+            return static_cast<size_t>(range >> 32);
+        }
+
+        static size_t remaining_(uint64_t range)
+        {
+            return begin_(range) < end_(range) ? end_(range) - begin_(range) : 0;
+        }
+
+        // Owners hammer their own range, keep every one on its own cache line unless PACKED_LAYOUT
+        struct alignas(HOT_FIELD_ALIGNMENT) range_slot
+        {
+            std::atomic<uint64_t> packed = 0;
+        };
+
+        bar::completion completion_;
+        std::span<const Task> chunk_;
+        std::array<range_slot, WORKER_COUNT> ranges_;
+    };
+
+    static_assert(CHUNK_SIZE <= 0xFFFF'FFFF, "hyb packs chunk indices into 32 bits");
+
+    // Interface for a seaprate thread (joins automatically)
+    class worker
+    {
+    public:
+        worker(const std::shared_ptr<master_control>& sp_mctrl, size_t index, std::optional<unsigned> cpu = {}, wake_mode wake = wake_mode::condvar, std::chrono::microseconds wake_spin = {})
+            :
+            sp_mctrl_{sp_mctrl},
+            index_{index},
+            cpu_{cpu},
+            doorbell_{wake, wake_spin},
+            thread_{&worker::run_, this}
+        {
+        }
+
+        void start_work()
+        {
+            doorbell_.ring([&]
+            {
+                b_working_ = true;
+            });
+        }
+
+        void kill()
+        {
+            doorbell_.ring([&]
+            {
+                LOG(LogWorker, Info, "Killing Worker...");
+                b_dying_ = true;
+            });
+        }
+
+        unsigned int get_result() const
+        {
+            return accumulation_;
+        }
+
+        float get_job_work_time() const
+        {
+            return work_time_;
+        }
+
+        size_t get_num_heavy_items_processed() const
+        {
+            return num_heavy_items_processed_;
+        }
+
+        size_t get_num_steals() const
+        {
+            return num_steals_;
+        }
+
+        bar::clock::time_point get_start_time() const
+        {
+            return start_time_;
+        }
+
+        ~worker()
+        {
+            kill();
+        }
+
+    private:
+        void process_data_()
+        {
+            LOG(LogWorker, Info, "Process data for Worker");
+            // Tallied in locals and stored once per chunk, see HOT_FIELD_ALIGNMENT
+            unsigned int accumulation = 0;
+            size_t num_heavy_items_processed = 0;
+            size_t num_steals = 0;
+            do
+            {
+                while(const Task* p_task = sp_mctrl_->claim(index_))
+                {
+                    accumulation += p_task->process();
+                    num_heavy_items_processed += p_task->_b_heavy ? 1 : 0;
+                }
+            } while(sp_mctrl_->steal(index_) && ++num_steals);
+            accumulation_ += accumulation;
+            num_heavy_items_processed_ = num_heavy_items_processed;
+            num_steals_ = num_steals;
+            LOG(LogWorker, Info, "Processed data: {} for Worker", accumulation_);
+        }
+
+        void run_()
+        {
+            if(cpu_)
+                topo::pin_current_thread(*cpu_);
+
+            while (true)
+            {
+                MyTimer timer;
+                doorbell_.wait([this] { return b_working_ || b_dying_; });
+
+                if (b_dying_)
+                    break;
+
+                start_time_ = bar::clock::now();
+                timer.Mark();
+
+                process_data_();
+
+                work_time_ = timer.Peek();
+
+                b_working_ = false;
+                sp_mctrl_->signal_done();
+            }
+        }
+
+        std::shared_ptr<master_control> sp_mctrl_;
+        size_t index_;
+        std::optional<unsigned> cpu_;
+        bar::doorbell doorbell_;
+
+        // shared memory
+        unsigned int accumulation_ = 0;
+        bool b_dying_ = false;
+        bool b_working_ = false;
+        float work_time_ = -1.f;
+        size_t num_heavy_items_processed_ = 0;
+        size_t num_steals_ = 0;
+        bar::clock::time_point start_time_;
+        // Declared last: the thread starts in the constructor and uses every member above
+        std::jthread thread_;
+    };
+
+
+    int do_experiment(stm::chunk_source chunks, const experiment_settings& settings = {})
+    {
+        LOG(LogTemp, Info, "Starting experiment");
+            
+        MyTimer total_timer;
+        total_timer.Mark();
+
+        auto sp_mctrl = std::make_shared<master_control>(settings.barrier);
+
+        LOG(LogTemp, Info, "Allocate p_workers");
+        
+        std::vector<std::unique_ptr<worker>> p_workers;
+        const auto cpus = topo::cpu_topology::get().plan(settings.aff, WORKER_COUNT);
+        for(size_t j = 0; j < WORKER_COUNT; j++)
+        {
+            p_workers.push_back(std::make_unique<worker>(sp_mctrl, j, cpus[j], settings.wake, settings.wake_spin));
+        }
+
+        std::vector<chunk_timing_info> timings;
+        timings.reserve(CHUNK_COUNT);
+
+        size_t total_steals = 0;
+        MyTimer chunk_timer;
+        for(const auto& chunk : chunks)
+        {
+            chunk_timer.Mark();
+            sp_mctrl->set_chunk(chunk);
+            for(auto& p_worker : p_workers)
+            {
+                p_worker->start_work();
+            }
+            const float sync_overhead = sp_mctrl->wait_for_all_done();
+            
+            // Report timing for threads
+            const auto chunk_time = chunk_timer.Peek();
+            timings.push_back
+            (
+              {}  
+            );
+            for(size_t i = 0; i < WORKER_COUNT; i++)
+            {
+                timings.back().number_of_heavy_items_per_thread[i] = p_workers[i]->get_num_heavy_items_processed();
+                timings.back().time_spent_working_per_thread[i] = p_workers[i]->get_job_work_time();
+                timings.back().total_chunk_time = chunk_time;
+                total_steals += p_workers[i]->get_num_steals();
+            }
+            timings.back().sync_overhead = sync_overhead;
+            const auto [it_first, it_last] = std::ranges::minmax_element(p_workers, {}, &worker::get_start_time);
+            timings.back().start_skew = std::chrono::duration<float>((*it_last)->get_start_time() - (*it_first)->get_start_time()).count();
+        }
+
+        const float t = total_timer.Peek();
+        
+        // Accumlate the overall result.
+        unsigned int final_result = 0;
+        LOG_ALWAYS(LogTemp, Info, "Accumulating final result");
+        for(const auto& w : p_workers)
+        {
+            final_result += w->get_result();
+        }
+        LOG_ALWAYS(LogTemp, Info, "Result is {}\n Time taken: {}\n Steals: {}\n Layout: {}", final_result, t, total_steals, PACKED_LAYOUT_ENABLED ? "packed" : "cache line isolated");
+        LOG_ALWAYS(LogTemp, Info, "Sync overhead per chunk: {}us, start skew: {}us",
+            mean_per_chunk(timings, &chunk_timing_info::sync_overhead) * 1'000'000.f, mean_per_chunk(timings, &chunk_timing_info::start_skew) * 1'000'000.f);
+
+        
+        // Output csv of chunk timings
+        // worktime, idletime, numberofheavies x workers = totaltime, total heavies
+
+        if constexpr (CHUNK_MEASUREMENT_ENABLED)
+        {
+            write_csv(timings);
+        }
+
+        
+        getchar();
+
+        return 0;
+    }
+}
@@ -0,0 +1,232 @@
+﻿#pragma once
+#include <iostream>
+#include <thread>
+#include <optional>
+#include <format>
+#include <atomic>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <numeric>
+#include "Constants.h"
+#include "Task.h"
+#include "Settings.h"
+#include "MpmcQueue.h"
+#include "Locks.h"
+#include "Stream.h"
+#include "../include/MyTimer.h"
+#include "Logging.h"
+
+// Producer threads push tasks into a bounded MPMC ring while the workers drain it, the way tasks arrive when they are
+// ingested during the run rather than sitting in a chunk up front. There are no chunk rounds and no barrier, the run
+// ends when the last producer has left and the ring is empty
+namespace ing
+{
+    using clock = std::chrono::steady_clock;
+
+    // What travels through the ring: the task and when its producer had it ready
+    struct ticket
+    {
+        Task task;
+        clock::time_point produced;
+    };
+
+    // Latencies in power of two buckets of nanoseconds, bucket b holds [2^(b-1), 2^b)
+    using latency_histogram = std::array<size_t, 64>;
+
+    // Upper bound of the bucket the quantile falls in
+    inline float quantile_us(const latency_histogram& histogram, double q)
+    {
+        const auto total = std::accumulate(histogram.begin(), histogram.end(), size_t{0});
+        size_t seen = 0;
+        for(size_t b = 0; b < histogram.size(); b++)
+        {
+            seen += histogram[b];
+            if(total > 0 && double(seen) >= q * double(total))
+                return float(uint64_t{1} << b) / 1'000.f;
+        }
+        return 0.f;
+    }
+
+    struct alignas(HOT_FIELD_ALIGNMENT) producer_stats
+    {
+        size_t items = 0;
+        float active_time = 0.f;
+        // Seconds spent in front of a full ring, and the longest single push
+        float full_wait = 0.f;
+        float max_push_wait = 0.f;
+    };
+
+    struct alignas(HOT_FIELD_ALIGNMENT) consumer_stats
+    {
+        unsigned int accumulation = 0;
+        size_t items = 0;
+        size_t num_heavy_items_processed = 0;
+        float active_time = 0.f;
+        // Seconds spent in front of an empty ring
+        float empty_wait = 0.f;
+        // From produced to dequeued
+        double total_latency = 0.;
+        float max_latency = 0.f;
+        latency_histogram latencies{};
+    };
+
+    // Producer index of producer_count takes every producer_count-th chunk
+    inline void produce(const Dataset& chunks, size_t index, size_t producer_count, tk::mpmc_queue<ticket>& ring, producer_stats& stats)
+    {
+        MyTimer timer;
+        timer.Mark();
+        for(size_t i_chunk = index; i_chunk < chunks.size(); i_chunk += producer_count)
+        {
+            for(const auto& t : chunks[i_chunk])
+            {
+                const ticket item{t, clock::now()};
+                if(!ring.try_push(item))
+                {
+                    locks::backoff wait;
+                    do
+                    {
+                        wait.pause();
+                    } while(!ring.try_push(item));
+                    const float waited = std::chrono::duration<float>(clock::now() - item.produced).count();
+                    stats.full_wait += waited;
+                    stats.max_push_wait = std::max(stats.max_push_wait, waited);
+                }
+                stats.items++;
+            }
+        }
+        stats.active_time = timer.Peek();
+    }
+
+    inline void consume(tk::mpmc_queue<ticket>& ring, const std::atomic<size_t>& producers_left, consumer_stats& stats)
+    {
+        MyTimer timer;
+        timer.Mark();
+        std::optional<clock::time_point> starved_since;
+        locks::backoff wait;
+        while(true)
+        {
+            // Read before the pop: once every producer has left, a failed pop means the ring stays empty
+            const bool drained = producers_left.load(std::memory_order_acquire) == 0;
+            if(auto item = ring.try_pop())
+            {
+                const auto now = clock::now();
+                if(starved_since)
+                {
+                    stats.empty_wait += std::chrono::duration<float>(now - *starved_since).count();
+                    starved_since.reset();
+                    wait = {};
+                }
+                const auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - item->produced);
+                stats.total_latency += std::chrono::duration<double>(latency).count();
+                stats.max_latency = std::max(stats.max_latency, std::chrono::duration<float>(latency).count());
+                stats.latencies[std::bit_width(static_cast<uint64_t>(latency.count()))]++;
+
+                stats.accumulation += item->task.process();
+                stats.num_heavy_items_processed += item->task._b_heavy ? 1 : 0;
+                stats.items++;
+            }
+            else if(drained)
+            {
+                break;
+            }
+            else
+            {
+                if(!starved_since)
+                    starved_since = clock::now();
+                wait.pause();
+            }
+        }
+        stats.active_time = timer.Peek();
+    }
+
+    int do_experiment(stm::chunk_source chunks, const experiment_settings& settings = {})
+    {
+        // Every producer walks its own share of the chunks
+        const auto& dataset = chunks.dataset();
+
+        LOG(LogTemp, Info, "Starting experiment");
+            
+        MyTimer total_timer;
+        total_timer.Mark();
+
+        tk::mpmc_queue<ticket> ring{settings.ring_capacity};
+        const size_t producer_count = std::max<size_t>(settings.producer_count, 1);
+        std::atomic<size_t> producers_left{producer_count};
+        std::vector<producer_stats> producers(producer_count);
+        std::array<consumer_stats, WORKER_COUNT> consumers{};
+
+        {
+            // Workers first, producers on the cpus after them
+            const auto cpus = topo::cpu_topology::get().plan(settings.aff, WORKER_COUNT + producer_count);
+            std::vector<std::jthread> threads;
+            for(size_t j = 0; j < WORKER_COUNT; j++)
+            {
+                threads.emplace_back([&, j]
+                {
+                    if(cpus[j])
+                        topo::pin_current_thread(*cpus[j]);
+                    consume(ring, producers_left, consumers[j]);
+                });
+            }
+            for(size_t p = 0; p < producer_count; p++)
+            {
+                threads.emplace_back([&, p]
+                {
+                    if(cpus[WORKER_COUNT + p])
+                        topo::pin_current_thread(*cpus[WORKER_COUNT + p]);
+                    produce(dataset, p, producer_count, ring, producers[p]);
+                    producers_left.fetch_sub(1, std::memory_order_release);
+                });
+            }
+        }
+
+        const float t = total_timer.Peek();
+        
+        // Accumlate the overall result.
+        unsigned int final_result = 0;
+        size_t total_items = 0;
+        float dequeue_time = 0.f;
+        double total_latency = 0.;
+        float max_latency = 0.f;
+        latency_histogram latencies{};
+        std::array<float, WORKER_COUNT> empty_wait{};
+        LOG_ALWAYS(LogTemp, Info, "Accumulating final result");
+        for(size_t j = 0; j < WORKER_COUNT; j++)
+        {
+            const auto& c = consumers[j];
+            final_result += c.accumulation;
+            total_items += c.items;
+            dequeue_time = std::max(dequeue_time, c.active_time);
+            total_latency += c.total_latency;
+            max_latency = std::max(max_latency, c.max_latency);
+            for(size_t b = 0; b < latencies.size(); b++)
+                latencies[b] += c.latencies[b];
+            empty_wait[j] = c.empty_wait;
+        }
+
+        float enqueue_time = 0.f;
+        float full_wait = 0.f;
+        float max_push_wait = 0.f;
+        for(const auto& p : producers)
+        {
+            enqueue_time = std::max(enqueue_time, p.active_time);
+            full_wait += p.full_wait;
+            max_push_wait = std::max(max_push_wait, p.max_push_wait);
+        }
+
+        LOG_ALWAYS(LogTemp, Info, "Result is {}\n Time taken: {}\n Producers: {}, ring capacity: {}", final_result, t, producer_count, ring.capacity());
+        LOG_ALWAYS(LogTemp, Info, "Enqueue: {:.3f} M tasks/s, full ring wait {}s, longest push {:.1f}us",
+            double(total_items) / enqueue_time / 1e6, full_wait, max_push_wait * 1'000'000.f);
+        LOG_ALWAYS(LogTemp, Info, "Dequeue: {:.3f} M tasks/s, empty ring wait per worker: {}s",
+            double(total_items) / dequeue_time / 1e6, empty_wait);
+        LOG_ALWAYS(LogTemp, Info, "Latency produced to dequeued: mean {:.1f}us, p50 <= {:.1f}us, p99 <= {:.1f}us, max {:.1f}us",
+            total_items ? total_latency / double(total_items) * 1e6 : 0., quantile_us(latencies, .5), quantile_us(latencies, .99), max_latency * 1'000'000.f);
+
+        // No chunk rounds, so there is no chunk timings csv for this one
+        
+        getchar();
+
+        return 0;
+    }
+}
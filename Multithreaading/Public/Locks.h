@@ -0,0 +1,218 @@
+﻿#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include "Constants.h"
+#include "Spin.h"
+
+// Locks for the few places that stay lock based. Each one is Lockable (lock, try_lock, unlock), so it drops into
+// std::lock_guard and std::unique_lock like std::mutex does
+namespace locks
+{
+    using clock = std::chrono::steady_clock;
+
+    // Exponential backoff for spinning waiters: pause a little longer after every failed look, and once the pauses
+    // get long hand the cpu back, a waiter that never yields starves the holder when workers outnumber cpus
+    class backoff
+    {
+    public:
+        void pause()
+        {
+            if(spins_ < MAX_SPINS)
+            {
+                for(uint32_t i = 0; i < spins_; i++)
+                    tk::cpu_relax();
+                spins_ *= 2;
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+
+    private:
+        static constexpr uint32_t MAX_SPINS = 1024;
+        uint32_t spins_ = 1;
+    };
+
+    // Test and test-and-set: waiters spin on a plain load, only a free lock is worth the exchange
+    class ttas_lock
+    {
+    public:
+        void lock()
+        {
+            backoff wait;
+            while(true)
+            {
+                if(!locked_.exchange(true, std::memory_order_acquire))
+                    return;
+                while(locked_.load(std::memory_order_relaxed))
+                    wait.pause();
+            }
+        }
+
+        bool try_lock()
+        {
+            return !locked_.load(std::memory_order_relaxed) && !locked_.exchange(true, std::memory_order_acquire);
+        }
+
+        void unlock()
+        {
+            locked_.store(false, std::memory_order_release);
+        }
+
+    private:
+        alignas(HOT_FIELD_ALIGNMENT) std::atomic<bool> locked_{false};
+    };
+
+    // FIFO: every waiter draws a ticket and waits for it to be served; the next in line spins with backoff, the rest yield
+    class ticket_lock
+    {
+    public:
+        void lock()
+        {
+            const auto ticket = next_.fetch_add(1, std::memory_order_relaxed);
+            backoff wait;
+            while(true)
+            {
+                const auto serving = serving_.load(std::memory_order_acquire);
+                if(serving == ticket)
+                    return;
+                // Further back in line there is no point polling soon
+                if(ticket - serving > 1)
+                    std::this_thread::yield();
+                else
+                    wait.pause();
+            }
+        }
+
+        bool try_lock()
+        {
+            // The acquire pairs with the release in unlock, the exchange on next_ alone does not see the last holder's writes
+            auto serving = serving_.load(std::memory_order_acquire);
+            return next_.compare_exchange_strong(serving, serving + 1, std::memory_order_relaxed, std::memory_order_relaxed);
+        }
+
+        void unlock()
+        {
+            // Only the holder writes serving_
+            serving_.store(serving_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+    private:
+        // Drawing a ticket does not disturb the line the waiters poll
+        alignas(HOT_FIELD_ALIGNMENT) std::atomic<uint32_t> next_{0};
+        alignas(HOT_FIELD_ALIGNMENT) std::atomic<uint32_t> serving_{0};
+    };
+
+    // Mellor-Crummey and Scott queue lock: waiters line up in a linked list and each spins on its own node, so a
+    // release touches the next waiter's line only. The nodes are per thread, a thread holds one mcs_lock at a time
+    class mcs_lock
+    {
+    public:
+        void lock()
+        {
+            auto& me = local_node_();
+            me.next.store(nullptr, std::memory_order_relaxed);
+            me.locked.store(true, std::memory_order_relaxed);
+
+            const auto prev = tail_.exchange(&me, std::memory_order_acq_rel);
+            if(!prev)
+                return;
+
+            prev->next.store(&me, std::memory_order_release);
+            backoff wait;
+            while(me.locked.load(std::memory_order_acquire))
+                wait.pause();
+        }
+
+        bool try_lock()
+        {
+            auto& me = local_node_();
+            me.next.store(nullptr, std::memory_order_relaxed);
+            node* expected = nullptr;
+            return tail_.compare_exchange_strong(expected, &me, std::memory_order_acq_rel, std::memory_order_relaxed);
+        }
+
+        void unlock()
+        {
+            auto& me = local_node_();
+            auto next = me.next.load(std::memory_order_acquire);
+            if(!next)
+            {
+                // Nobody queued behind us yet: leave the lock empty, unless a waiter is between its exchange and its link
+                node* expected = &me;
+                if(tail_.compare_exchange_strong(expected, nullptr, std::memory_order_release, std::memory_order_relaxed))
+                    return;
+                backoff wait;
+                while(!(next = me.next.load(std::memory_order_acquire)))
+                    wait.pause();
+            }
+            next->locked.store(false, std::memory_order_release);
+        }
+
+    private:
+        struct alignas(HOT_FIELD_ALIGNMENT) node
+        {
+            std::atomic<node*> next{nullptr};
+            std::atomic<bool> locked{false};
+        };
+
+        static node& local_node_()
+        {
+            thread_local node n;
+            return n;
+        }
+
+        alignas(HOT_FIELD_ALIGNMENT) std::atomic<node*> tail_{nullptr};
+    };
+
+    // Three state mutex after Drepper's "Futexes are tricky": 0 free, 1 held, 2 held with sleepers. The uncontended
+    // path is a single compare exchange, sleeping goes through std::atomic::wait, which is a futex on Linux and
+    // WaitOnAddress on Windows, and unlock only wakes when somebody may be asleep
+    class futex_lock
+    {
+    public:
+        void lock()
+        {
+            uint32_t state = 0;
+            if(state_.compare_exchange_strong(state, 1, std::memory_order_acquire, std::memory_order_relaxed))
+                return;
+            if(state != 2)
+                state = state_.exchange(2, std::memory_order_acquire);
+            while(state != 0)
+            {
+                state_.wait(2, std::memory_order_relaxed);
+                state = state_.exchange(2, std::memory_order_acquire);
+            }
+        }
+
+        bool try_lock()
+        {
+            uint32_t state = 0;
+            return state_.compare_exchange_strong(state, 1, std::memory_order_acquire, std::memory_order_relaxed);
+        }
+
+        void unlock()
+        {
+            if(state_.exchange(0, std::memory_order_release) == 2)
+                state_.notify_one();
+        }
+
+    private:
+        alignas(HOT_FIELD_ALIGNMENT) std::atomic<uint32_t> state_{0};
+    };
+
+    // Takes the lock and adds the seconds spent waiting for it to contention, an uncontended acquire costs no clock reads
+    template<typename Lock>
+    void lock_timed(Lock& lock, float& contention)
+    {
+        if(lock.try_lock())
+            return;
+        const auto start = clock::now();
+        lock.lock();
+        contention += std::chrono::duration<float>(clock::now() - start).count();
+    }
+}
@@ -0,0 +1,96 @@
+﻿#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include "Constants.h"
+
+namespace tk {
+
+// Bounded lock-free multi-producer multi-consumer queue after Dmitry Vyukov's design. Every cell carries a sequence
+// number that says whose turn it is: pos means free for the producer claiming pos, pos + 1 means full for the consumer
+// claiming pos. Producers and consumers each race on their own counter only, and never wait on each other inside
+// the queue; a full or empty queue is reported back and the caller decides how to wait
+template<typename T>
+class mpmc_queue {
+public:
+    // The capacity is rounded up to a power of two
+    explicit mpmc_queue(size_t capacity)
+        :
+        mask_{std::bit_ceil(std::max<size_t>(capacity, 2)) - 1},
+        cells_{std::make_unique<cell[]>(mask_ + 1)}
+    {
+        for(size_t i = 0; i <= mask_; i++) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const {
+        return mask_ + 1;
+    }
+
+    // False when the queue is full
+    bool try_push(T value) {
+        auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while(true) {
+            auto& c = cells_[pos & mask_];
+            const auto seq = c.sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if(diff == 0) {
+                if(enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.value = std::move(value);
+                    c.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0) {
+                // The consumer of the previous lap has not emptied the cell yet
+                return false;
+            }
+            else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // nullopt when the queue is empty, or when the producer owning the next cell has not finished writing it
+    std::optional<T> try_pop() {
+        auto pos = dequeue_pos_.load(std::memory_order_relaxed);
+        while(true) {
+            auto& c = cells_[pos & mask_];
+            const auto seq = c.sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if(diff == 0) {
+                if(dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    std::optional<T> value{std::move(c.value)};
+                    // Free for the producer one lap ahead
+                    c.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                    return value;
+                }
+            }
+            else if(diff < 0) {
+                return std::nullopt;
+            }
+            else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    const size_t mask_;
+    const std::unique_ptr<cell[]> cells_;
+    // Producers and consumers never share a line, unless PACKED_LAYOUT
+    alignas(HOT_FIELD_ALIGNMENT) std::atomic<size_t> enqueue_pos_{0};
+    alignas(HOT_FIELD_ALIGNMENT) std::atomic<size_t> dequeue_pos_{0};
+};
+
+} // namespace tk
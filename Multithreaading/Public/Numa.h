@@ -0,0 +1,241 @@
+﻿#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Topology.h"
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace numa
+{
+    inline constexpr size_t page_alignment = 4096;
+
+    // Page aligned, and default-initialises so that allocating a vector of trivial types touches no memory
+    template<typename T>
+    struct page_allocator
+    {
+        using value_type = T;
+
+        page_allocator() noexcept = default;
+        template<typename U>
+        page_allocator(const page_allocator<U>&) noexcept {}
+
+        T* allocate(size_t n)
+        {
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{ page_alignment }));
+        }
+
+        void deallocate(T* p, size_t) noexcept
+        {
+            ::operator delete(p, std::align_val_t{ page_alignment });
+        }
+
+        template<typename U>
+        void construct(U* p) noexcept(std::is_nothrow_default_constructible_v<U>)
+        {
+            ::new (static_cast<void*>(p)) U;
+        }
+
+        template<typename U, typename... Args>
+        void construct(U* p, Args&&... args)
+        {
+            ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+        }
+
+        template<typename U>
+        bool operator==(const page_allocator<U>&) const noexcept
+        {
+            return true;
+        }
+    };
+
+    enum class allocation_mode
+    {
+        main_thread, // whoever generates the data touches it first, every page lands on the main thread's node
+        first_touch, // each worker touches its own slices from its own thread before generation
+        bind         // mbind each worker's slices to its node, falls back to first_touch where mbind is unavailable
+    };
+
+    struct placement
+    {
+        allocation_mode mode = allocation_mode::main_thread;
+        topo::affinity aff;
+    };
+
+    // Memory of chunk_count chunks of chunk_bytes each, every chunk cut into slice_count equal slices; slice i belongs to worker i
+    struct sliced_region
+    {
+        std::byte* base;
+        size_t chunk_count;
+        size_t chunk_bytes;
+        size_t slice_count;
+
+        std::pair<std::byte*, std::byte*> slice(size_t chunk, size_t worker) const
+        {
+            const size_t slice_bytes = chunk_bytes / slice_count;
+            std::byte* first = base + chunk * chunk_bytes + worker * slice_bytes;
+            std::byte* last = worker + 1 == slice_count ? base + (chunk + 1) * chunk_bytes : first + slice_bytes;
+            return { first, last };
+        }
+    };
+
+    struct locality_report
+    {
+        bool available = false; // page queries need Linux, and pinned workers to know their node
+        size_t local_pages = 0;
+        size_t remote_pages = 0;
+        size_t unknown_pages = 0; // not faulted in yet, or the query failed
+    };
+
+    inline std::byte* align_up(std::byte* p)
+    {
+        const auto address = reinterpret_cast<std::uintptr_t>(p);
+        return reinterpret_cast<std::byte*>((address + page_alignment - 1) & ~(page_alignment - 1));
+    }
+
+    // Node of every worker's planned cpu, nullopt for workers the OS is free to move around
+    inline std::vector<std::optional<unsigned>> worker_nodes(const topo::affinity& aff, size_t worker_count)
+    {
+        const auto& topology = topo::cpu_topology::get();
+        std::vector<std::optional<unsigned>> nodes;
+        for(const auto& cpu : topology.plan(aff, worker_count))
+        {
+            const auto* p_cpu = cpu ? topology.find(*cpu) : nullptr;
+            nodes.push_back(p_cpu ? std::optional{ p_cpu->node } : std::nullopt);
+        }
+        return nodes;
+    }
+
+    inline bool bind_to_node(std::byte* first, std::byte* last, unsigned node)
+    {
+#if defined(__linux__) && defined(SYS_mbind)
+        if(first >= last)
+            return true;
+
+        constexpr int mpol_bind = 2;
+        constexpr size_t mask_bits = sizeof(unsigned long) * 8;
+        std::vector<unsigned long> node_mask(node / mask_bits + 1, 0);
+        node_mask[node / mask_bits] |= 1ul << (node % mask_bits);
+        return syscall(SYS_mbind, first, static_cast<unsigned long>(last - first), mpol_bind, node_mask.data(), node_mask.size() * mask_bits + 1, 0) == 0;
+#else
+        (void)first; (void)last; (void)node;
+        return false;
+#endif
+    }
+
+    inline void first_touch(const sliced_region& region, const topo::affinity& aff)
+    {
+        const auto cpus = topo::cpu_topology::get().plan(aff, region.slice_count);
+        std::vector<std::jthread> threads;
+        for(size_t worker = 0; worker < region.slice_count; worker++)
+        {
+            threads.emplace_back([&region, worker, cpu = cpus[worker]]
+            {
+                if(cpu)
+                    topo::pin_current_thread(*cpu);
+                for(size_t chunk = 0; chunk < region.chunk_count; chunk++)
+                {
+                    const auto [first, last] = region.slice(chunk, worker);
+                    std::memset(first, 0, static_cast<size_t>(last - first));
+                }
+            });
+        }
+    }
+
+    // Decides which node every slice lives on, before anything is written to it
+    inline void place(const sliced_region& region, const placement& where)
+    {
+        switch (where.mode)
+        {
+        case allocation_mode::main_thread:
+            return;
+        case allocation_mode::first_touch:
+            first_touch(region, where.aff);
+            return;
+        case allocation_mode::bind:
+            break;
+        }
+
+        const auto nodes = worker_nodes(where.aff, region.slice_count);
+        const size_t node_count = topo::cpu_topology::get().node_count();
+        bool bound = true;
+        for(size_t chunk = 0; chunk < region.chunk_count && bound; chunk++)
+        {
+            for(size_t worker = 0; worker < region.slice_count && bound; worker++)
+            {
+                // Rounding both ends up tiles the pages: a page goes to the slice its first byte belongs to
+                const auto [first, last] = region.slice(chunk, worker);
+                bound = bind_to_node(align_up(first), align_up(last), nodes[worker].value_or(static_cast<unsigned>(worker % node_count)));
+            }
+        }
+        if(!bound)
+            first_touch(region, where.aff);
+    }
+
+    // Counts how many pages of every worker's slices sit on that worker's node
+    inline locality_report report_locality(const sliced_region& region, const topo::affinity& aff)
+    {
+        locality_report report;
+#if defined(__linux__) && defined(SYS_move_pages)
+        const auto nodes = worker_nodes(aff, region.slice_count);
+        for(const auto& node : nodes)
+        {
+            if(!node)
+                return report;
+        }
+
+        report.available = true;
+        std::vector<void*> pages;
+        std::vector<int> status;
+        for(size_t worker = 0; worker < region.slice_count; worker++)
+        {
+            pages.clear();
+            for(size_t chunk = 0; chunk < region.chunk_count; chunk++)
+            {
+                const auto [first, last] = region.slice(chunk, worker);
+                for(auto* page = align_up(first); page < align_up(last); page += page_alignment)
+                    pages.push_back(page);
+            }
+
+            // No target nodes: the kernel only reports where each page currently is
+            status.assign(pages.size(), -1);
+            if(syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0)
+            {
+                report.unknown_pages += pages.size();
+                continue;
+            }
+            for(const int page_node : status)
+            {
+                if(page_node < 0)
+                    report.unknown_pages++;
+                else if(static_cast<unsigned>(page_node) == *nodes[worker])
+                    report.local_pages++;
+                else
+                    report.remote_pages++;
+            }
+        }
+#else
+        (void)region; (void)aff;
+#endif
+        return report;
+    }
+
+    inline allocation_mode parse_allocation_mode(const std::string& text)
+    {
+        if(text == "main") return allocation_mode::main_thread;
+        if(text == "first-touch") return allocation_mode::first_touch;
+        if(text == "bind") return allocation_mode::bind;
+        throw std::invalid_argument("Unknown allocation mode: " + text);
+    }
+}
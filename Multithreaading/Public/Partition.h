@@ -0,0 +1,99 @@
+﻿#pragma once
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <numeric>
+#include <span>
+#include <vector>
+#include "Constants.h"
+#include "Task.h"
+#include "Soa.h"
+#include "ThreadPool.h"
+
+namespace part
+{
+    // Estimated cost of one task; only compared with the cost of other tasks, so any unit will do
+    using cost_function = size_t(*)(const Task&);
+
+    // What Task::process spends: one unit per loop iteration
+    inline size_t iteration_cost(const Task& task)
+    {
+        return task._b_heavy ? HEAVY_ITERATIONS : LIGHT_ITERATIONS;
+    }
+
+    // Subset i of a chunk is [cuts[i], cuts[i + 1])
+    using chunk_cuts = std::array<size_t, WORKER_COUNT + 1>;
+
+    // Subset subset_index of a chunk cut at cuts
+    inline std::span<const Task> subset(std::span<const Task> chunk, const chunk_cuts& cuts, size_t subset_index)
+    {
+        return chunk.subspan(cuts[subset_index], cuts[subset_index + 1] - cuts[subset_index]);
+    }
+
+    inline soa::range subset(const soa::chunk& chunk, const chunk_cuts& cuts, size_t subset_index)
+    {
+        return {&chunk, cuts[subset_index], cuts[subset_index + 1]};
+    }
+
+    // SUBSET_SIZE tasks each, what pre always did
+    inline chunk_cuts equal_count_cuts()
+    {
+        chunk_cuts cuts;
+        for(size_t i = 0; i <= WORKER_COUNT; i++)
+            cuts[i] = i * SUBSET_SIZE;
+        return cuts;
+    }
+
+    // Cuts where the prefix sum of the cost crosses each multiple of total / WORKER_COUNT, so every subset ends up
+    // within one task's cost of an equal share
+    inline chunk_cuts cuts_from_prefix(std::span<const size_t, CHUNK_SIZE> prefix)
+    {
+        const size_t total = prefix.back();
+
+        chunk_cuts cuts;
+        cuts[0] = 0;
+        cuts[WORKER_COUNT] = CHUNK_SIZE;
+        for(size_t i = 1; i < WORKER_COUNT; i++)
+        {
+            const size_t target = total * i / WORKER_COUNT;
+            cuts[i] = static_cast<size_t>(std::ranges::upper_bound(prefix, target) - prefix.begin());
+        }
+        return cuts;
+    }
+
+    // prefix is scratch space of CHUNK_SIZE entries
+    inline chunk_cuts equal_cost_cuts(std::span<const Task, CHUNK_SIZE> chunk, cost_function cost, std::span<size_t, CHUNK_SIZE> prefix)
+    {
+        std::transform_inclusive_scan(chunk.begin(), chunk.end(), prefix.begin(), std::plus<>{}, cost);
+        return cuts_from_prefix(prefix);
+    }
+
+    inline chunk_cuts equal_cost_cuts(const soa::chunk& chunk, cost_function cost, std::span<size_t, CHUNK_SIZE> prefix)
+    {
+        size_t total = 0;
+        for(size_t i = 0; i < CHUNK_SIZE; i++)
+        {
+            total += cost(Task{ .val = chunk.vals[i], ._b_heavy = chunk.is_heavy(i) });
+            prefix[i] = total;
+        }
+        return cuts_from_prefix(prefix);
+    }
+
+    // Equal cost cuts for every chunk of the dataset, either layout; chunks are independent of each other, so the pool
+    // cuts them in parallel
+    template<typename Chunks>
+    std::vector<chunk_cuts> partition(const Chunks& chunks, cost_function cost, tk::thread_pool& pool)
+    {
+        constexpr size_t chunks_per_range = 8;
+        std::vector<chunk_cuts> cuts(chunks.size());
+        pool.parallel_for(size_t{0}, chunks.size(), chunks_per_range, [&](size_t begin, size_t end)
+        {
+            std::vector<size_t> prefix(CHUNK_SIZE);
+            for(size_t i = begin; i < end; i++)
+            {
+                cuts[i] = equal_cost_cuts(chunks[i], cost, std::span<size_t, CHUNK_SIZE>{prefix});
+            }
+        });
+        return cuts;
+    }
+}
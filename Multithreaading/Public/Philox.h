@@ -0,0 +1,42 @@
+﻿#pragma once
+#include <array>
+#include <cstdint>
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"): a keyed bijection of a 128 bit counter
+// instead of a generator with state, so any draw can be computed on its own, on any thread, in any order
+namespace rng
+{
+    using philox_counter = std::array<uint32_t, 4>;
+    using philox_key = std::array<uint32_t, 2>;
+
+    inline philox_counter philox4x32(philox_counter counter, philox_key key)
+    {
+        constexpr uint32_t MULTIPLIER_0 = 0xD2511F53;
+        constexpr uint32_t MULTIPLIER_1 = 0xCD9E8D57;
+        constexpr uint32_t WEYL_0 = 0x9E3779B9;
+        constexpr uint32_t WEYL_1 = 0xBB67AE85;
+
+        for(int round = 0; round < 10; round++)
+        {
+            const uint64_t product_0 = uint64_t{MULTIPLIER_0} * counter[0];
+            const uint64_t product_1 = uint64_t{MULTIPLIER_1} * counter[2];
+            counter =
+            {
+                static_cast<uint32_t>(product_1 >> 32) ^ counter[1] ^ key[0],
+                static_cast<uint32_t>(product_1),
+                static_cast<uint32_t>(product_0 >> 32) ^ counter[3] ^ key[1],
+                static_cast<uint32_t>(product_0),
+            };
+            key[0] += WEYL_0;
+            key[1] += WEYL_1;
+        }
+        return counter;
+    }
+
+    // Uniform in [0, 1) from 53 of the 64 bits
+    inline double to_unit(uint32_t high, uint32_t low)
+    {
+        const uint64_t bits = (uint64_t{high} << 32 | low) >> 11;
+        return static_cast<double>(bits) * 0x1.0p-53;
+    }
+}
@@ -0,0 +1,167 @@
+﻿#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <span>
+#include <vector>
+#include "Constants.h"
+#include "Timing.h"
+
+namespace pipeline
+{
+    using clock = std::chrono::steady_clock;
+
+    // One worker's stretch of work on one chunk
+    struct chunk_span
+    {
+        size_t chunk;
+        clock::time_point begin;
+        clock::time_point end;
+        size_t heavy_items;
+    };
+
+    // Replaces the per-chunk barrier: workers move on to later chunks as soon as they run out of work, but never more
+    // than depth chunks past the oldest chunk that is still in flight
+    class window
+    {
+    public:
+        window(size_t chunk_count, size_t depth, size_t units_per_chunk)
+            :
+            depth_{std::max<size_t>(depth, 1)},
+            remaining_(chunk_count)
+        {
+            for(auto& remaining : remaining_)
+                remaining.store(units_per_chunk, std::memory_order_relaxed);
+        }
+
+        // Blocks until chunk is inside the window
+        void acquire(size_t chunk)
+        {
+            auto retired = retired_.load(std::memory_order_acquire);
+            while(chunk >= retired + depth_)
+            {
+                retired_.wait(retired, std::memory_order_acquire);
+                retired = retired_.load(std::memory_order_acquire);
+            }
+        }
+
+        // Hands back units of work on chunk; the last one retires the chunk, and every finished chunk behind it
+        void finish(size_t chunk, size_t units)
+        {
+            if(units == 0 || remaining_[chunk].fetch_sub(units, std::memory_order_acq_rel) != units)
+                return;
+
+            std::lock_guard lk{mtx_};
+            auto retired = retired_.load(std::memory_order_relaxed);
+            while(retired < remaining_.size() && remaining_[retired].load(std::memory_order_acquire) == 0)
+                retired++;
+            retired_.store(retired, std::memory_order_release);
+            retired_.notify_all();
+        }
+
+    private:
+        const size_t depth_;
+        std::vector<std::atomic<size_t>> remaining_;
+        std::atomic<size_t> retired_ = 0;
+        std::mutex mtx_;
+    };
+
+    // Worker side bookkeeping: enters chunks through the window, hands the work done back when it leaves one,
+    // and records a chunk_span for every chunk it touched
+    class cursor
+    {
+    public:
+        cursor(window& w, std::vector<chunk_span>& spans)
+            :
+            window_{w},
+            spans_{spans}
+        {}
+
+        void enter(size_t chunk)
+        {
+            if(open_ && span_.chunk == chunk)
+                return;
+
+            // Finish the old chunk before waiting on the window, the wait may be for exactly that chunk
+            leave();
+            window_.acquire(chunk);
+            span_ = { .chunk = chunk, .begin = clock::now(), .end = {}, .heavy_items = 0 };
+            open_ = true;
+        }
+
+        void add(size_t units, size_t heavy_items)
+        {
+            units_ += units;
+            span_.heavy_items += heavy_items;
+        }
+
+        void leave()
+        {
+            if(!open_)
+                return;
+
+            span_.end = clock::now();
+            spans_.push_back(span_);
+            window_.finish(span_.chunk, units_);
+            units_ = 0;
+            open_ = false;
+        }
+
+        ~cursor()
+        {
+            leave();
+        }
+
+    private:
+        window& window_;
+        std::vector<chunk_span>& spans_;
+        chunk_span span_{};
+        size_t units_ = 0;
+        bool open_ = false;
+    };
+
+    // Cuts the run at the moments chunks retire: a chunk's time is the stretch between the retirement of the one before
+    // and its own, and a worker's work time is whatever it spent processing inside that stretch, on any chunk.
+    // That keeps the idle column of timings.csv meaning time nobody had work, like it does with a barrier.
+    inline std::vector<chunk_timing_info> to_chunk_timings(clock::time_point start, size_t chunk_count, std::span<const std::vector<chunk_span>> spans)
+    {
+        std::vector<clock::time_point> retired(chunk_count, start);
+        for(const auto& worker_spans : spans)
+        {
+            for(const auto& span : worker_spans)
+                retired[span.chunk] = std::max(retired[span.chunk], span.end);
+        }
+        // Chunks retire in order
+        for(size_t chunk = 1; chunk < chunk_count; chunk++)
+            retired[chunk] = std::max(retired[chunk], retired[chunk - 1]);
+
+        std::vector<chunk_timing_info> timings(chunk_count);
+        for(size_t chunk = 0; chunk < chunk_count; chunk++)
+        {
+            const auto stretch_begin = chunk > 0 ? retired[chunk - 1] : start;
+            timings[chunk].total_chunk_time = std::chrono::duration<float>(retired[chunk] - stretch_begin).count();
+        }
+
+        for(size_t worker = 0; worker < spans.size() && worker < WORKER_COUNT; worker++)
+        {
+            for(const auto& span : spans[worker])
+            {
+                timings[span.chunk].number_of_heavy_items_per_thread[worker] += span.heavy_items;
+
+                // Spread the span over every stretch it overlaps
+                auto chunk = static_cast<size_t>(std::ranges::lower_bound(retired, span.begin) - retired.begin());
+                for(; chunk < chunk_count; chunk++)
+                {
+                    const auto first = chunk > 0 ? std::max(span.begin, retired[chunk - 1]) : span.begin;
+                    const auto last = std::min(span.end, retired[chunk]);
+                    if(last > first)
+                        timings[chunk].time_spent_working_per_thread[worker] += std::chrono::duration<float>(last - first).count();
+                    if(retired[chunk] >= span.end)
+                        break;
+                }
+            }
+        }
+        return timings;
+    }
+}
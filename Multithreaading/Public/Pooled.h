@@ -0,0 +1,131 @@
+﻿#pragma once
+#include <iostream>
+#include <span>
+#include <format>
+#include "Constants.h"
+#include "Task.h"
+#include "Timing.h"
+#include "Settings.h"
+#include "ThreadPool.h"
+#include "Stream.h"
+#include "Soa.h"
+#include "../include/MyTimer.h"
+#include "Logging.h"
+
+namespace pld
+{
+    // Bookkeeping for one thread working through parallel_for, a cache line per slot unless PACKED_LAYOUT
+    struct alignas(HOT_FIELD_ALIGNMENT) slot_stats
+    {
+        unsigned int accumulation = 0;
+        float work_time = 0.f;
+        size_t num_heavy_items_processed = 0;
+    };
+
+    // [begin, end) of a chunk into the slot's bookkeeping; the AoS layout has no batch path, so the kernel goes unused
+    inline void process_range(const Dataset::value_type& chunk, size_t begin, size_t end, slot_stats& s, simd::batch_kernel)
+    {
+        soa::tally tally;
+        for(const auto& t : std::span{chunk}.subspan(begin, end - begin))
+        {
+            tally.accumulation += t.process();
+            tally.num_heavy_items_processed += t._b_heavy ? 1 : 0;
+        }
+        s.accumulation += tally.accumulation;
+        s.num_heavy_items_processed += tally.num_heavy_items_processed;
+    }
+
+    inline void process_range(const soa::chunk& chunk, size_t begin, size_t end, slot_stats& s, simd::batch_kernel kernel)
+    {
+        const auto tally = soa::process({&chunk, begin, end}, kernel);
+        s.accumulation += tally.accumulation;
+        s.num_heavy_items_processed += tally.num_heavy_items_processed;
+    }
+
+    // Chunks is a stm::chunk_source of AoS chunks or a soa::dataset
+    template<typename Chunks>
+    int run_chunks(Chunks& chunks, const experiment_settings& settings)
+    {
+        constexpr bool b_soa = std::same_as<std::remove_cvref_t<Chunks>, soa::dataset>;
+
+        LOG(LogTemp, Info, "Starting experiment");
+            
+        MyTimer total_timer;
+        total_timer.Mark();
+
+        // The master thread claims ranges too, it takes the pool's extra slot
+        tk::thread_pool pool{WORKER_COUNT - 1, {}, settings.aff};
+        std::array<slot_stats, WORKER_COUNT> stats{};
+        const auto kernel = simd::kernel_for(settings.kernel);
+
+        std::vector<chunk_timing_info> timings;
+        timings.reserve(CHUNK_COUNT);
+        
+        MyTimer chunk_timer;
+        for(const auto& chunk : chunks)
+        {
+            chunk_timer.Mark();
+            for(auto& s : stats)
+            {
+                s.work_time = 0.f;
+                s.num_heavy_items_processed = 0;
+            }
+
+            pool.parallel_for(size_t{0}, CHUNK_SIZE, PARALLEL_FOR_GRAIN, [&](size_t begin, size_t end)
+            {
+                MyTimer timer;
+                auto& s = stats[pool.current_slot()];
+                process_range(chunk, begin, end, s, kernel);
+                s.work_time += timer.Peek();
+            });
+            
+            // Report timing for threads
+            const auto chunk_time = chunk_timer.Peek();
+            timings.push_back
+            (
+              {}  
+            );
+            for(size_t i = 0; i < WORKER_COUNT; i++)
+            {
+                timings.back().number_of_heavy_items_per_thread[i] = stats[i].num_heavy_items_processed;
+                timings.back().time_spent_working_per_thread[i] = stats[i].work_time;
+                timings.back().total_chunk_time = chunk_time;
+            }
+        }
+
+        const float t = total_timer.Peek();
+        
+        // Accumlate the overall result.
+        unsigned int final_result = 0;
+        LOG_ALWAYS(LogTemp, Info, "Accumulating final result");
+        for(const auto& s : stats)
+        {
+            final_result += s.accumulation;
+        }
+        LOG_ALWAYS(LogTemp, Info, "Result is {}\n Time taken: {}\n Task layout: {}, kernel: {}", final_result, t, b_soa ? "soa" : "aos", simd_level_name(simd::resolve(settings.kernel)));
+
+        
+        // Output csv of chunk timings
+        // worktime, idletime, numberofheavies x workers = totaltime, total heavies
+
+        if constexpr (CHUNK_MEASUREMENT_ENABLED)
+        {
+            write_csv(timings);
+        }
+
+        
+        getchar();
+
+        return 0;
+    }
+
+    int do_experiment(stm::chunk_source chunks, const experiment_settings& settings = {})
+    {
+        return run_chunks(chunks, settings);
+    }
+
+    int do_experiment(const soa::dataset& chunks, const experiment_settings& settings = {})
+    {
+        return run_chunks(chunks, settings);
+    }
+}
@@ -2,11 +2,18 @@
 #include <iostream>
 #include <thread>
 #include <mutex>
+#include <optional>
 #include <span>
 #include <format>
 #include "Constants.h"
 #include "Task.h"
 #include "Timing.h"
+#include "Settings.h"
+#include "Barrier.h"
+#include "Pipeline.h"
+#include "Partition.h"
+#include "Stream.h"
+#include "Soa.h"
 #include "../include/MyTimer.h"
 #include "Logging.h"
 
@@ -16,77 +23,120 @@ namespace pre
     class master_control
     {
     public:
-        master_control()
+        master_control(barrier_kind barrier = barrier_kind::condvar, simd::batch_kernel kernel = nullptr)
             :
-            lk_{mtx_},
-            done_count_{0}
+            completion_{barrier, WORKER_COUNT},
+            kernel_{kernel}
         {}
     
         void signal_done()
         {
-            bool needs_notification = false;
-            {
-                std::lock_guard lk{mtx_};
-                LOG(LogMasterControl, Info, "Work completed");
-                ++done_count_;
-
-                if(done_count_ == WORKER_COUNT)
-                {
-                    LOG(LogMasterControl, Info, "All work is done");
-                    needs_notification = true;
-                }
-            }
-            if(needs_notification)
-                cv_.notify_one();
+            LOG(LogMasterControl, Info, "Work completed");
+            completion_.arrive();
         }
     
-        void wait_for_all_done()
+        // Returns the synchronisation overhead of the chunk
+        float wait_for_all_done()
         {
             LOG(LogMasterControl, Info, "Waiting for all other to be done.....");
-            cv_.wait(lk_, [this]{return done_count_ == WORKER_COUNT;});
+            return completion_.wait();
+        }
+
+        // The dataset, and where each of its chunks is cut between the workers
+        void set_dataset(std::span<const Dataset::value_type> chunks, std::span<const part::chunk_cuts> cuts)
+        {
+            chunks_ = chunks;
+            cuts_ = cuts;
+        }
+
+        // Pipelined runs: every worker walks all chunks on its own, the window keeps them within depth chunks of each other
+        void set_pipeline(size_t depth)
+        {
+            p_window_ = std::make_unique<pipeline::window>(chunks_.size(), depth, WORKER_COUNT);
+        }
+
+        size_t get_chunk_count() const
+        {
+            return chunks_.size();
+        }
 
-            done_count_ = 0;
+        std::span<const Task> get_subset(size_t chunk_index, size_t subset_index) const
+        {
+            return part::subset(chunks_[chunk_index], cuts_[chunk_index], subset_index);
+        }
+
+        pipeline::window& get_window()
+        {
+            return *p_window_;
+        }
+
+        // What SoA jobs run through, nullptr for Task::process per task
+        simd::batch_kernel get_kernel() const
+        {
+            return kernel_;
         }
     
     private:
-        std::condition_variable cv_;
-        std::mutex mtx_;
-        std::unique_lock<std::mutex> lk_;
+        bar::completion completion_;
+        simd::batch_kernel kernel_;
     
-        // shared memory
-        int done_count_;
+        std::span<const Dataset::value_type> chunks_;
+        std::span<const part::chunk_cuts> cuts_;
+        std::unique_ptr<pipeline::window> p_window_;
     };
 
     // Interface for a seaprate thread (joins automatically)
     class worker
     {
     public:
-        worker(const std::shared_ptr<master_control>& sp_mctrl)
+        worker(const std::shared_ptr<master_control>& sp_mctrl, std::optional<unsigned> cpu = {}, wake_mode wake = wake_mode::condvar, std::chrono::microseconds wake_spin = {})
             :
             sp_mctrl_{sp_mctrl},
+            cpu_{cpu},
+            doorbell_{wake, wake_spin},
             thread_{&worker::run_, this}
         {
         }
 
         void set_job(std::span<const Task> dataset)
         {
+            doorbell_.ring([&]
             {
-                std::lock_guard lk{mtx_};
                 LOG(LogWorker, Info, "Setting job for Worker..");
                 input_ = dataset;
-                // Reset the accumulation every time a job is set
-            }
-            cv_.notify_one();
+                // An equal cost cut may leave a subset empty, the flag still wakes the worker for it
+                b_has_job_ = true;
+            });
+        }
+
+        void set_job(soa::range tasks)
+        {
+            doorbell_.ring([&]
+            {
+                LOG(LogWorker, Info, "Setting SoA job for Worker..");
+                soa_input_ = tasks;
+                b_has_job_ = true;
+            });
+        }
+
+        // Process subset subset_index of every chunk set with master_control::set_dataset
+        void set_pipeline_job(size_t subset_index)
+        {
+            doorbell_.ring([&]
+            {
+                LOG(LogWorker, Info, "Setting pipeline job for Worker..");
+                subset_index_ = subset_index;
+                b_pipelined_ = true;
+            });
         }
 
         void kill()
         {
+            doorbell_.ring([&]
             {
-                std::lock_guard lk{mtx_};
                 LOG(LogWorker, Info, "Killing Worker...");
                 b_dying = true;
-            }
-            cv_.notify_one();
+            });
         }
 
         unsigned int get_result() const
@@ -104,6 +154,16 @@ namespace pre
             return num_heavy_items_processed;
         }
 
+        const std::vector<pipeline::chunk_span>& get_spans() const
+        {
+            return spans_;
+        }
+
+        bar::clock::time_point get_start_time() const
+        {
+            return start_time_;
+        }
+
         ~worker()
         {
             kill();
@@ -112,61 +172,109 @@ namespace pre
     private:
         void process_data_()
         {
-            num_heavy_items_processed = 0;
-
             LOG(LogWorker, Info, "Process data for Worker");
+            // Tallied locally and stored once per chunk, see HOT_FIELD_ALIGNMENT
+            soa::tally tally;
+            if(soa_input_.p_chunk)
+            {
+                tally = soa::process(soa_input_, sp_mctrl_->get_kernel());
+            }
             for (const auto& t : input_)
             {
-                accumulation_ += t.process();
-                num_heavy_items_processed += t._b_heavy ? 1 : 0;
+                tally.accumulation += t.process();
+                tally.num_heavy_items_processed += t._b_heavy ? 1 : 0;
+            }
+            accumulation_ += tally.accumulation;
+            num_heavy_items_processed = tally.num_heavy_items_processed;
+            LOG(LogWorker, Info, "Processed data: {} for Worker", accumulation_);
+        }
+
+        void process_pipeline_()
+        {
+            LOG(LogWorker, Info, "Process pipeline for Worker");
+            spans_.clear();
+            pipeline::cursor cursor{sp_mctrl_->get_window(), spans_};
+            unsigned int accumulation = 0;
+            for(size_t i = 0; i < sp_mctrl_->get_chunk_count(); i++)
+            {
+                cursor.enter(i);
+                size_t heavy = 0;
+                for (const auto& t : sp_mctrl_->get_subset(i, subset_index_))
+                {
+                    accumulation += t.process();
+                    heavy += t._b_heavy ? 1 : 0;
+                }
+                cursor.add(1, heavy);
             }
+            cursor.leave();
+            accumulation_ += accumulation;
             LOG(LogWorker, Info, "Processed data: {} for Worker", accumulation_);
         }
 
         void run_()
         {
-            std::unique_lock lk{mtx_};
+            if(cpu_)
+                topo::pin_current_thread(*cpu_);
+
             while (true)
             {
                 MyTimer timer;
-                cv_.wait(lk, [this] { return !input_.empty() || b_dying; });
+                doorbell_.wait([this] { return b_has_job_ || b_pipelined_ || b_dying; });
 
                 if (b_dying)
                     break;
 
+                start_time_ = bar::clock::now();
                 timer.Mark();
 
-                process_data_();
+                if (b_pipelined_)
+                    process_pipeline_();
+                else
+                    process_data_();
 
                 work_time_ = timer.Peek();
 
                 input_ = {};
+                soa_input_ = {};
+                b_has_job_ = false;
+                b_pipelined_ = false;
                 sp_mctrl_->signal_done();
             }
         }
 
         std::shared_ptr<master_control> sp_mctrl_;
-        std::jthread thread_;
-        std::condition_variable cv_;
-        std::mutex mtx_;
+        std::optional<unsigned> cpu_;
+        bar::doorbell doorbell_;
 
         // shared memoru
         std::span<const Task> input_;
+        soa::range soa_input_;
+        bool b_has_job_ = false;
         unsigned int accumulation_ = 0;
         bool b_dying = false;
         float work_time_ = -1.f;
         size_t num_heavy_items_processed = 0;
+        size_t subset_index_ = 0;
+        bool b_pipelined_ = false;
+        std::vector<pipeline::chunk_span> spans_;
+        bar::clock::time_point start_time_;
+        // Declared last: the thread starts in the constructor and uses every member above
+        std::jthread thread_;
     };
 
 
-    int do_experiment(Dataset chunks)
+    // Chunks is a stm::chunk_source of AoS chunks or a soa::dataset
+    template<typename Chunks>
+    int run_chunks(Chunks& chunks, const experiment_settings& settings)
     {
+        constexpr bool b_soa = std::same_as<std::remove_cvref_t<Chunks>, soa::dataset>;
+
         LOG(LogTemp, Info, "Starting experiment");
             
         MyTimer total_timer;
         total_timer.Mark();
 
-       auto sp_mctrl = std::make_shared<master_control>();
+       auto sp_mctrl = std::make_shared<master_control>(settings.barrier, simd::kernel_for(settings.kernel));
         
         if(!sp_mctrl)
             throw std::exception("Failed to create MasterControl");
@@ -174,35 +282,93 @@ namespace pre
         LOG(LogTemp, Info, "Allocate p_workers");
         
         std::vector<std::unique_ptr<worker>> p_workers;
+        const auto cpus = topo::cpu_topology::get().plan(settings.aff, WORKER_COUNT);
         for(size_t j = 0; j < WORKER_COUNT; j++)
         {
-            p_workers.push_back(std::make_unique<worker>(sp_mctrl));
+            p_workers.push_back(std::make_unique<worker>(sp_mctrl, cpus[j], settings.wake, settings.wake_spin));
+        }
+
+        // Where each chunk is cut between the workers. A streamed chunk is only there once its turn has come, the master
+        // cuts it then; so is a chunk of a mapped file, cutting them all up front would read the whole file in first
+        bool b_cut_per_chunk = false;
+        if constexpr (!b_soa)
+            b_cut_per_chunk = !chunks.has_dataset();
+        std::vector<part::chunk_cuts> partition(chunks.size(), part::equal_count_cuts());
+        if(settings.partition == partition_mode::equal_cost && !b_cut_per_chunk)
+        {
+            MyTimer partition_timer;
+            partition_timer.Mark();
+            tk::thread_pool pool{WORKER_COUNT, {}, settings.aff};
+            if constexpr (b_soa)
+                partition = part::partition(chunks, &part::iteration_cost, pool);
+            else
+                partition = part::partition(chunks.dataset(), &part::iteration_cost, pool);
+            LOG_ALWAYS(LogTemp, Info, "Partitioned by cost in {}", partition_timer.Peek());
         }
 
         std::vector<chunk_timing_info> timings;
         timings.reserve(CHUNK_COUNT);
         
-        MyTimer chunk_timer;
-        for(const auto& chunk : chunks)
+        if(settings.pipeline_window > 0)
         {
-            chunk_timer.Mark();
-            for(size_t i_subs = 0; i_subs < WORKER_COUNT; i_subs++)
+            if constexpr (b_soa)
             {
-                p_workers[i_subs]->set_job(std::span{&chunk[i_subs * SUBSET_SIZE], SUBSET_SIZE});
+                throw std::invalid_argument("Pipelined pre runs take the AoS layout");
             }
-            sp_mctrl->wait_for_all_done();
-            
-            // Report timing for threads
-            const auto chunk_time = chunk_timer.Peek();
-            timings.push_back
-            (
-              {}  
-            );
-            for(size_t i = 0; i < WORKER_COUNT; i++)
+            else
             {
-                timings.back().number_of_heavy_items_per_thread[i] = p_workers[i]->get_num_heavy_items_processed();
-                timings.back().time_spent_working_per_thread[i] = p_workers[i]->get_job_work_time();
-                timings.back().total_chunk_time = chunk_time;
+                // One wake-up and one wait for the whole run, chunk timings are rebuilt from what the workers recorded
+                const auto start = pipeline::clock::now();
+                sp_mctrl->set_dataset(chunks.dataset(), partition);
+                sp_mctrl->set_pipeline(settings.pipeline_window);
+                for(size_t i_subs = 0; i_subs < WORKER_COUNT; i_subs++)
+                {
+                    p_workers[i_subs]->set_pipeline_job(i_subs);
+                }
+                sp_mctrl->wait_for_all_done();
+
+                std::vector<std::vector<pipeline::chunk_span>> spans;
+                for(const auto& p_worker : p_workers)
+                {
+                    spans.push_back(p_worker->get_spans());
+                }
+                timings = pipeline::to_chunk_timings(start, chunks.size(), spans);
+            }
+        }
+        else
+        {
+            MyTimer chunk_timer;
+            std::vector<size_t> prefix(b_cut_per_chunk ? CHUNK_SIZE : 0);
+            size_t i_chunk = 0;
+            for(const auto& chunk : chunks)
+            {
+                chunk_timer.Mark();
+                if(settings.partition == partition_mode::equal_cost && b_cut_per_chunk)
+                {
+                    partition[i_chunk] = part::equal_cost_cuts(chunk, &part::iteration_cost, std::span<size_t, CHUNK_SIZE>{prefix});
+                }
+                for(size_t i_subs = 0; i_subs < WORKER_COUNT; i_subs++)
+                {
+                    p_workers[i_subs]->set_job(part::subset(chunk, partition[i_chunk], i_subs));
+                }
+                i_chunk++;
+                const float sync_overhead = sp_mctrl->wait_for_all_done();
+                
+                // Report timing for threads
+                const auto chunk_time = chunk_timer.Peek();
+                timings.push_back
+                (
+                  {}  
+                );
+                for(size_t i = 0; i < WORKER_COUNT; i++)
+                {
+                    timings.back().number_of_heavy_items_per_thread[i] = p_workers[i]->get_num_heavy_items_processed();
+                    timings.back().time_spent_working_per_thread[i] = p_workers[i]->get_job_work_time();
+                    timings.back().total_chunk_time = chunk_time;
+                }
+                timings.back().sync_overhead = sync_overhead;
+                const auto [it_first, it_last] = std::ranges::minmax_element(p_workers, {}, &worker::get_start_time);
+                timings.back().start_skew = std::chrono::duration<float>((*it_last)->get_start_time() - (*it_first)->get_start_time()).count();
             }
         }
 
@@ -216,7 +382,9 @@ namespace pre
         {
             final_result += w->get_result();
         }
-        LOG_ALWAYS(LogTemp, Info, "Result is {}\n Time taken: {}", final_result, t);
+        LOG_ALWAYS(LogTemp, Info, "Result is {}\n Time taken: {}\n Task layout: {}, kernel: {}", final_result, t, b_soa ? "soa" : "aos", simd_level_name(simd::resolve(settings.kernel)));
+        LOG_ALWAYS(LogTemp, Info, "Sync overhead per chunk: {}us, start skew: {}us",
+            mean_per_chunk(timings, &chunk_timing_info::sync_overhead) * 1'000'000.f, mean_per_chunk(timings, &chunk_timing_info::start_skew) * 1'000'000.f);
 
         
         // Output csv of chunk timings
@@ -232,4 +400,14 @@ namespace pre
 
         return 0;
     }
+
+    int do_experiment(stm::chunk_source chunks, const experiment_settings& settings = {})
+    {
+        return run_chunks(chunks, settings);
+    }
+
+    int do_experiment(const soa::dataset& chunks, const experiment_settings& settings = {})
+    {
+        return run_chunks(chunks, settings);
+    }
 }
@@ -2,50 +2,44 @@
 #include <iostream>
 #include <thread>
 #include <mutex>
+#include <optional>
 #include <span>
 #include <format>
+#include <numeric>
 #include "Constants.h"
 #include "Task.h"
 #include "Timing.h"
+#include "Settings.h"
+#include "Barrier.h"
+#include "Pipeline.h"
+#include "Locks.h"
+#include "Stream.h"
 #include "../include/MyTimer.h"
 #include "Logging.h"
 
 namespace que
 {
-    // Interface for the main thread
+    // Interface for the main thread. Every task is claimed under a Lock, std::mutex or one of the locks:: policies
+    template<typename Lock = std::mutex>
     class MasterControl
     {
     public:
-        MasterControl()
+        MasterControl(barrier_kind barrier = barrier_kind::condvar)
             :
-            _lk{_mtx},
-            _done_count{0}
+            _completion{barrier, WORKER_COUNT}
         {}
     
         void signal_Done()
         {
-            bool needs_notification = false;
-            {
-                std::lock_guard lk{_mtx};
-                LOG(LogMasterControl, Info, "Work completed");
-                ++_done_count;
-
-                if(_done_count == WORKER_COUNT)
-                {
-                    LOG(LogMasterControl, Info, "All work is done");
-                    needs_notification = true;
-                }
-            }
-            if(needs_notification)
-                _cv.notify_one();
+            LOG(LogMasterControl, Info, "Work completed");
+            _completion.arrive();
         }
     
-        void wait_For_All_Done()
+        // Returns the synchronisation overhead of the chunk
+        float wait_For_All_Done()
         {
             LOG(LogMasterControl, Info, "Waiting for all other to be done.....");
-            _cv.wait(_lk, [this]{return _done_count == WORKER_COUNT;});
-
-            _done_count = 0;
+            return _completion.wait();
         }
 
         void set_Chunk(std::span<const Task> chunk)
@@ -54,9 +48,29 @@ namespace que
             _current_chunk = chunk;
         }
 
-        const Task* get_Task()
+        // Pipelined runs: one queue over every chunk back to back, the window keeps workers within depth chunks of the oldest unfinished one
+        void set_Pipeline(std::span<const Dataset::value_type> chunks, size_t depth)
         {
-            std::lock_guard lck{_mtx};
+            _idx = 0;
+            _chunks = chunks;
+            _p_window = std::make_unique<pipeline::window>(chunks.size(), depth, CHUNK_SIZE);
+        }
+
+        bool is_Pipelined() const
+        {
+            return _p_window != nullptr;
+        }
+
+        pipeline::window& get_Window()
+        {
+            return *_p_window;
+        }
+
+        // Seconds spent waiting for the lock are added to contention
+        const Task* get_Task(float& contention)
+        {
+            locks::lock_timed(_mtx, contention);
+            std::lock_guard lck{_mtx, std::adopt_lock};
             const auto i = _idx++;
             
             if(i >= CHUNK_SIZE)
@@ -66,45 +80,59 @@ namespace que
             
             return &_current_chunk[i];
         }
+
+        // Next task of the pipelined queue together with the index of its chunk, nullptr once every chunk is drained
+        std::pair<size_t, const Task*> get_Pipelined_Task(float& contention)
+        {
+            locks::lock_timed(_mtx, contention);
+            std::lock_guard lck{_mtx, std::adopt_lock};
+            const auto i = _idx++;
+
+            if(i >= _chunks.size() * CHUNK_SIZE)
+            {
+                return {_chunks.size(), nullptr};
+            }
+
+            return {i / CHUNK_SIZE, &_chunks[i / CHUNK_SIZE][i % CHUNK_SIZE]};
+        }
     private:
-        std::condition_variable _cv;
-        std::mutex _mtx;
-        std::unique_lock<std::mutex> _lk;
+        bar::completion _completion;
+        Lock _mtx;
         std::span<const Task> _current_chunk;
+        std::span<const Dataset::value_type> _chunks;
+        std::unique_ptr<pipeline::window> _p_window;
         // shared memory
-        int _done_count;
         size_t _idx = 0;
     };
 
     // Interface for a seaprate thread (joins automatically)
+    template<typename Lock = std::mutex>
     class Worker
     {
     public:
-        Worker(const std::shared_ptr<MasterControl>& p_Mctrl)
+        Worker(const std::shared_ptr<MasterControl<Lock>>& p_Mctrl, std::optional<unsigned> cpu = {}, wake_mode wake = wake_mode::condvar, std::chrono::microseconds wake_spin = {})
             :
             _p_Mctrl{p_Mctrl},
+            _cpu{cpu},
+            _doorbell{wake, wake_spin},
             _thread{&Worker::_run, this}
         {
         }
 
         void start_Work()
         {
+            _doorbell.ring([&]
             {
-                std::lock_guard lk{_mtx};
                 _b_working = true;
-            }
-            _cv.notify_one();
-            
+            });
         }
         void kill()
         {
+            _doorbell.ring([&]
             {
-                std::lock_guard lk{_mtx};
                 LOG(LogWorker, Info, "Killing Worker...");
                 _b_dying = true;
-            }
-            
-            _cv.notify_one();
+            });
         }
 
         unsigned int get_Result() const
@@ -122,6 +150,27 @@ namespace que
             return _num_heavy_items_processed;
         }
 
+        // Seconds waited for the lock during the last job, and over every job so far
+        float get_Lock_Wait() const
+        {
+            return _lock_wait;
+        }
+
+        float get_Total_Lock_Wait() const
+        {
+            return _total_lock_wait;
+        }
+
+        const std::vector<pipeline::chunk_span>& get_Spans() const
+        {
+            return _spans;
+        }
+
+        bar::clock::time_point get_Start_Time() const
+        {
+            return _start_time;
+        }
+
         ~Worker()
         {
             kill();
@@ -130,44 +179,75 @@ namespace que
     private:
         void _process_Data()
         {
-            _num_heavy_items_processed = 0;
-
             LOG(LogWorker, Info, "Process data for Worker");
-            while(auto p_task = _p_Mctrl->get_Task())
+            // Tallied in locals and stored once per chunk, see HOT_FIELD_ALIGNMENT
+            unsigned int accumulation = 0;
+            size_t num_heavy_items_processed = 0;
+            while(auto p_task = _p_Mctrl->get_Task(_lock_wait))
             {
-                _accumulation += p_task->process();
-                _num_heavy_items_processed += p_task->_b_heavy ? 1 : 0;
+                accumulation += p_task->process();
+                num_heavy_items_processed += p_task->_b_heavy ? 1 : 0;
             }
+            _accumulation += accumulation;
+            _num_heavy_items_processed = num_heavy_items_processed;
             
             LOG(LogWorker, Info, "Processed data: {} for Worker", _accumulation);
         }
 
+        void _process_Pipeline()
+        {
+            LOG(LogWorker, Info, "Process pipeline for Worker");
+            _spans.clear();
+            pipeline::cursor cursor{_p_Mctrl->get_Window(), _spans};
+            unsigned int accumulation = 0;
+            while(true)
+            {
+                const auto [chunk, p_task] = _p_Mctrl->get_Pipelined_Task(_lock_wait);
+                if(!p_task)
+                    break;
+
+                cursor.enter(chunk);
+                accumulation += p_task->process();
+                cursor.add(1, p_task->_b_heavy ? 1 : 0);
+            }
+            cursor.leave();
+            _accumulation += accumulation;
+            LOG(LogWorker, Info, "Processed data: {} for Worker", _accumulation);
+        }
+
         void _run()
         {
-            std::unique_lock lk{_mtx};
+            if(_cpu)
+                topo::pin_current_thread(*_cpu);
+
             while (true)
             {
                 MyTimer timer;
-                _cv.wait(lk, [this] { return _b_working || _b_dying; });
+                _doorbell.wait([this] { return _b_working || _b_dying; });
 
                 if (_b_dying)
                     break;
 
+                _start_time = bar::clock::now();
+                _lock_wait = 0.f;
                 timer.Mark();
 
-                _process_Data();
+                if (_p_Mctrl->is_Pipelined())
+                    _process_Pipeline();
+                else
+                    _process_Data();
 
                 _work_time = timer.Peek();
+                _total_lock_wait += _lock_wait;
 
                 _b_working = false;
                 _p_Mctrl->signal_Done();
             }
         }
 
-        std::shared_ptr<MasterControl> _p_Mctrl;
-        std::jthread _thread;
-        std::condition_variable _cv;
-        std::mutex _mtx;
+        std::shared_ptr<MasterControl<Lock>> _p_Mctrl;
+        std::optional<unsigned> _cpu;
+        bar::doorbell _doorbell;
 
         // shared memoru
         unsigned int _accumulation = 0;
@@ -175,54 +255,97 @@ namespace que
         bool _b_working = false;
         float _work_time = -1.f;
         size_t _num_heavy_items_processed = 0;
+        float _lock_wait = 0.f;
+        float _total_lock_wait = 0.f;
+        std::vector<pipeline::chunk_span> _spans;
+        bar::clock::time_point _start_time;
+        // Declared last: the thread starts in the constructor and uses every member above
+        std::jthread _thread;
     };
 
 
-    int do_Experiment(Dataset chunks)
+    // What one run over the dataset produced
+    struct RunResult
+    {
+        unsigned int result;
+        float time_taken;
+        std::vector<chunk_timing_info> timings;
+        // Seconds each worker waited for the queue's lock over the whole run
+        std::array<float, WORKER_COUNT> lock_wait;
+    };
+
+    template<typename Lock>
+    RunResult run_Chunks(stm::chunk_source chunks, const experiment_settings& settings)
     {
         LOG(LogTemp, Info, "Starting experiment");
             
         MyTimer total_timer;
         total_timer.Mark();
 
-       auto sp_mctrl = std::make_shared<MasterControl>();
+       auto sp_mctrl = std::make_shared<MasterControl<Lock>>(settings.barrier);
         
         if(!sp_mctrl)
             throw std::exception("Failed to create MasterControl");
 
         LOG(LogTemp, Info, "Allocate p_workers");
         
-        std::vector<std::unique_ptr<Worker>> p_workers;
+        std::vector<std::unique_ptr<Worker<Lock>>> p_workers;
+        const auto cpus = topo::cpu_topology::get().plan(settings.aff, WORKER_COUNT);
         for(size_t j = 0; j < WORKER_COUNT; j++)
         {
-            p_workers.push_back(std::make_unique<Worker>(sp_mctrl));
+            p_workers.push_back(std::make_unique<Worker<Lock>>(sp_mctrl, cpus[j], settings.wake, settings.wake_spin));
         }
 
         std::vector<chunk_timing_info> timings;
         timings.reserve(CHUNK_COUNT);
         
-        MyTimer chunk_timer;
-        for(const auto& chunk : chunks)
+        if(settings.pipeline_window > 0)
         {
-            chunk_timer.Mark();
-            sp_mctrl->set_Chunk(chunk);
+            // One wake-up and one wait for the whole run, chunk timings are rebuilt from what the workers recorded
+            const auto start = pipeline::clock::now();
+            sp_mctrl->set_Pipeline(chunks.dataset(), settings.pipeline_window);
             for(auto& p_worker : p_workers)
             {
                 p_worker->start_Work();
             }
             sp_mctrl->wait_For_All_Done();
-            
-            // Report timing for threads
-            const auto chunk_time = chunk_timer.Peek();
-            timings.push_back
-            (
-              {}  
-            );
-            for(size_t i = 0; i < WORKER_COUNT; i++)
+
+            std::vector<std::vector<pipeline::chunk_span>> spans;
+            for(const auto& p_worker : p_workers)
             {
-                timings.back().number_of_heavy_items_per_thread[i] = p_workers[i]->get_Num_Heavy_Items_Processed();
-                timings.back().time_spent_working_per_thread[i] = p_workers[i]->get_Job_Work_Time();
-                timings.back().total_chunk_time = chunk_time;
+                spans.push_back(p_worker->get_Spans());
+            }
+            timings = pipeline::to_chunk_timings(start, chunks.size(), spans);
+        }
+        else
+        {
+            MyTimer chunk_timer;
+            for(const auto& chunk : chunks)
+            {
+                chunk_timer.Mark();
+                sp_mctrl->set_Chunk(chunk);
+                for(auto& p_worker : p_workers)
+                {
+                    p_worker->start_Work();
+                }
+                const float sync_overhead = sp_mctrl->wait_For_All_Done();
+                
+                // Report timing for threads
+                const auto chunk_time = chunk_timer.Peek();
+                timings.push_back
+                (
+                  {}  
+                );
+                for(size_t i = 0; i < WORKER_COUNT; i++)
+                {
+                    timings.back().number_of_heavy_items_per_thread[i] = p_workers[i]->get_Num_Heavy_Items_Processed();
+                    timings.back().time_spent_working_per_thread[i] = p_workers[i]->get_Job_Work_Time();
+                    timings.back().lock_wait_per_thread[i] = p_workers[i]->get_Lock_Wait();
+                    timings.back().total_chunk_time = chunk_time;
+                }
+                timings.back().sync_overhead = sync_overhead;
+                const auto [it_first, it_last] = std::ranges::minmax_element(p_workers, {}, &Worker<Lock>::get_Start_Time);
+                timings.back().start_skew = std::chrono::duration<float>((*it_last)->get_Start_Time() - (*it_first)->get_Start_Time()).count();
             }
         }
 
@@ -230,13 +353,44 @@ namespace que
         
         // Accumlate the overall result.
         unsigned int final_result = 0;
-        LOG_ALWAYS(LogTemp, Info, "Accumulating final result");
-        for(const auto& w : p_workers)
+        std::array<float, WORKER_COUNT> lock_wait{};
+        LOG(LogTemp, Info, "Accumulating final result");
+        for(size_t i = 0; i < WORKER_COUNT; i++)
         {
-            final_result += w->get_Result();
+            final_result += p_workers[i]->get_Result();
+            lock_wait[i] = p_workers[i]->get_Total_Lock_Wait();
         }
-        
-        LOG_ALWAYS(LogTemp, Info, "Result is {}\n Time taken: {}", final_result, t);
+
+        return {final_result, t, std::move(timings), lock_wait};
+    }
+
+    // The run_Chunks instantiation for the lock picked at run time
+    RunResult run_Experiment(stm::chunk_source chunks, const experiment_settings& settings)
+    {
+        switch (settings.lock)
+        {
+        case lock_kind::mutex:
+            return run_Chunks<std::mutex>(chunks, settings);
+        case lock_kind::ttas:
+            return run_Chunks<locks::ttas_lock>(chunks, settings);
+        case lock_kind::ticket:
+            return run_Chunks<locks::ticket_lock>(chunks, settings);
+        case lock_kind::mcs:
+            return run_Chunks<locks::mcs_lock>(chunks, settings);
+        case lock_kind::futex:
+            return run_Chunks<locks::futex_lock>(chunks, settings);
+        default:
+            throw std::invalid_argument("Unknown lock");
+        }
+    }
+
+    int do_Experiment(stm::chunk_source chunks, const experiment_settings& settings = {})
+    {
+        const auto run = run_Experiment(chunks, settings);
+        LOG_ALWAYS(LogTemp, Info, "Result is {}\n Time taken: {}\n Lock: {}", run.result, run.time_taken, lock_kind_name(settings.lock));
+        LOG_ALWAYS(LogTemp, Info, "Sync overhead per chunk: {}us, start skew: {}us",
+            mean_per_chunk(run.timings, &chunk_timing_info::sync_overhead) * 1'000'000.f, mean_per_chunk(run.timings, &chunk_timing_info::start_skew) * 1'000'000.f);
+        LOG_ALWAYS(LogTemp, Info, "Lock wait per worker: {}s", run.lock_wait);
 
         
         // Output csv of chunk timings
@@ -244,7 +398,7 @@ namespace que
 
         if constexpr (CHUNK_MEASUREMENT_ENABLED)
         {
-            write_csv(timings);
+            write_csv(run.timings);
         }
 
         
@@ -252,4 +406,31 @@ namespace que
 
         return 0;
     }
+
+    // Runs the dataset once with every lock and prints time and contention side by side
+    int do_Lock_Sweep(stm::chunk_source chunks, const experiment_settings& base = {})
+    {
+        // Every lock walks the same chunks
+        const auto& dataset = chunks.dataset();
+        auto settings = base;
+        constexpr std::array kinds{lock_kind::mutex, lock_kind::ttas, lock_kind::ticket, lock_kind::mcs, lock_kind::futex};
+
+        bool all_identical = true;
+        std::optional<unsigned int> first_result;
+        std::cout << std::format("{:<8}{:>12}{:>16}{:>16}   result\n", "lock", "time", "lock wait", "worst worker");
+        for(const auto kind : kinds)
+        {
+            settings.lock = kind;
+            const auto run = run_Experiment(dataset, settings);
+            if(!first_result)
+                first_result = run.result;
+            all_identical = all_identical && run.result == *first_result;
+
+            const float total_wait = std::accumulate(run.lock_wait.begin(), run.lock_wait.end(), 0.f);
+            std::cout << std::format("{:<8}{:>11.4f}s{:>15.4f}s{:>15.4f}s   {}\n",
+                lock_kind_name(kind), run.time_taken, total_wait, std::ranges::max(run.lock_wait), run.result);
+        }
+
+        return all_identical ? 0 : 1;
+    }
 }
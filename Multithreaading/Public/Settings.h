@@ -0,0 +1,216 @@
+﻿#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include "Constants.h"
+#include "Topology.h"
+
+// How atq workers claim indices from the shared counter, after OpenMP's schedule kinds
+enum class claim_policy
+{
+    per_item,      // one fetch_add per task
+    static_blocks, // block k goes to worker k % WORKER_COUNT, no shared counter at all
+    dynamic,       // one fetch_add per fixed size block
+    guided         // one fetch_add per block, blocks shrink as the chunk drains
+};
+
+// How the master of pre, que, atq and hyb waits for the workers at the end of a chunk
+enum class barrier_kind
+{
+    condvar,     // counter under a mutex, condition_variable wake-up
+    atomic_wait, // atomic counter, the last worker wakes the master through std::atomic::notify_one
+    std_barrier  // std::barrier over the workers and the master
+};
+
+// How the master of pre, que, atq and hyb wakes a worker for the next chunk
+enum class wake_mode
+{
+    condvar, // flag under the worker's mutex, condition_variable notify
+    epoch    // per worker epoch counter, std::atomic::wait / notify_all
+};
+
+// How pre cuts a chunk between its workers
+enum class partition_mode
+{
+    equal_count, // SUBSET_SIZE tasks each
+    equal_cost   // equal estimated cost each, from prefix sums of the per task cost
+};
+
+// The lock que's workers take for every task
+enum class lock_kind
+{
+    mutex,  // std::mutex
+    ttas,   // test and test-and-set spinlock with exponential backoff
+    ticket, // FIFO ticket spinlock
+    mcs,    // MCS queue lock, every waiter spins on its own node
+    futex   // three state mutex sleeping in std::atomic::wait
+};
+
+// How the task data is laid out in memory
+enum class task_layout
+{
+    aos, // an array of Task per chunk
+    soa  // values back to back plus a heavy bitmap per chunk, pre and pld only
+};
+
+// Instruction set of the batch kernel for Task::process
+enum class simd_level
+{
+    scalar,    // Task::process per task, libm's sin, cos and exp
+    automatic, // the widest one the cpu supports
+    sse2,
+    avx2,
+    avx512,
+    fast       // scalar, minimax polynomials in place of libm; a tiny share of results differ, see FastMath.h
+};
+
+// Per run knobs shared by the experiment engines; every engine reads the ones that apply to it
+struct experiment_settings
+{
+    topo::affinity aff;
+
+    claim_policy claim = claim_policy::per_item;
+    // Block size for static and dynamic, smallest block for guided
+    size_t claim_block = 64;
+    // Ordering of the fetch_adds on atq's claim counter: relaxed, acq_rel or seq_cst
+    std::memory_order claim_order = std::memory_order_seq_cst;
+
+    // 0 keeps the barrier after every chunk; otherwise pre, que and atq workers run up to this many chunks
+    // past the oldest unfinished one
+    size_t pipeline_window = 0;
+
+    barrier_kind barrier = barrier_kind::condvar;
+
+    wake_mode wake = wake_mode::condvar;
+    // How long an epoch worker polls before it sleeps in atomic::wait
+    std::chrono::microseconds wake_spin{0};
+
+    partition_mode partition = partition_mode::equal_count;
+
+    lock_kind lock = lock_kind::mutex;
+
+    // ing: threads filling the ring, and its capacity in tasks (rounded up to a power of two)
+    size_t producer_count = 1;
+    size_t ring_capacity = 4096;
+
+    // 0 generates the whole dataset before the run; otherwise a generator thread streams chunks into this many
+    // reusable buffers while the engine runs. Pipelined runs, ing and the sweeps need the whole dataset
+    size_t stream_depth = 0;
+    // Key of the dataset generator: the same seed gives the same tasks on every machine
+    uint64_t seed = DEFAULT_SEED;
+    // Threads generating a dataset up front, 0 for one per physical core; the tasks do not depend on it
+    size_t generation_threads = 0;
+
+    task_layout layout = task_layout::aos;
+
+    // Kernel the SoA path and spl's light lane run their tasks through
+    simd_level kernel = simd_level::scalar;
+};
+
+inline claim_policy parse_claim_policy(const std::string& text)
+{
+    if(text == "per-item") return claim_policy::per_item;
+    if(text == "static") return claim_policy::static_blocks;
+    if(text == "dynamic") return claim_policy::dynamic;
+    if(text == "guided") return claim_policy::guided;
+    throw std::invalid_argument("Unknown claim policy: " + text);
+}
+
+inline std::memory_order parse_claim_order(const std::string& text)
+{
+    if(text == "relaxed") return std::memory_order_relaxed;
+    if(text == "acq-rel") return std::memory_order_acq_rel;
+    if(text == "seq-cst") return std::memory_order_seq_cst;
+    throw std::invalid_argument("Unknown claim order: " + text);
+}
+
+inline const char* claim_order_name(std::memory_order order)
+{
+    switch (order)
+    {
+    case std::memory_order_relaxed: return "relaxed";
+    case std::memory_order_acq_rel: return "acq-rel";
+    case std::memory_order_seq_cst: return "seq-cst";
+    default: return "unsupported";
+    }
+}
+
+inline barrier_kind parse_barrier_kind(const std::string& text)
+{
+    if(text == "condvar") return barrier_kind::condvar;
+    if(text == "atomic") return barrier_kind::atomic_wait;
+    if(text == "std") return barrier_kind::std_barrier;
+    throw std::invalid_argument("Unknown barrier: " + text);
+}
+
+inline wake_mode parse_wake_mode(const std::string& text)
+{
+    if(text == "condvar") return wake_mode::condvar;
+    if(text == "epoch") return wake_mode::epoch;
+    throw std::invalid_argument("Unknown wake mode: " + text);
+}
+
+inline partition_mode parse_partition_mode(const std::string& text)
+{
+    if(text == "count") return partition_mode::equal_count;
+    if(text == "cost") return partition_mode::equal_cost;
+    throw std::invalid_argument("Unknown partition mode: " + text);
+}
+
+inline lock_kind parse_lock_kind(const std::string& text)
+{
+    if(text == "mutex") return lock_kind::mutex;
+    if(text == "ttas") return lock_kind::ttas;
+    if(text == "ticket") return lock_kind::ticket;
+    if(text == "mcs") return lock_kind::mcs;
+    if(text == "futex") return lock_kind::futex;
+    throw std::invalid_argument("Unknown lock: " + text);
+}
+
+inline const char* lock_kind_name(lock_kind kind)
+{
+    switch (kind)
+    {
+    case lock_kind::mutex: return "mutex";
+    case lock_kind::ttas: return "ttas";
+    case lock_kind::ticket: return "ticket";
+    case lock_kind::mcs: return "mcs";
+    case lock_kind::futex: return "futex";
+    default: return "unsupported";
+    }
+}
+
+inline task_layout parse_task_layout(const std::string& text)
+{
+    if(text == "aos") return task_layout::aos;
+    if(text == "soa") return task_layout::soa;
+    throw std::invalid_argument("Unknown task layout: " + text);
+}
+
+inline simd_level parse_simd_level(const std::string& text)
+{
+    if(text == "scalar") return simd_level::scalar;
+    if(text == "auto") return simd_level::automatic;
+    if(text == "sse2") return simd_level::sse2;
+    if(text == "avx2") return simd_level::avx2;
+    if(text == "avx512") return simd_level::avx512;
+    if(text == "fast") return simd_level::fast;
+    throw std::invalid_argument("Unknown kernel: " + text);
+}
+
+inline const char* simd_level_name(simd_level level)
+{
+    switch (level)
+    {
+    case simd_level::scalar: return "scalar";
+    case simd_level::automatic: return "auto";
+    case simd_level::sse2: return "sse2";
+    case simd_level::avx2: return "avx2";
+    case simd_level::avx512: return "avx512";
+    case simd_level::fast: return "fast";
+    default: return "unsupported";
+    }
+}
@@ -0,0 +1,229 @@
+﻿#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include "Constants.h"
+#include "Settings.h"
+#include "Task.h"
+#include "FastMath.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define SIMD_X86 0
+#endif
+
+// Batch versions of Task::process: a run of values that are all light or all heavy in, one result per value out.
+// SSE2, AVX2 and AVX-512 process 4, 8 and 16 tasks per step with polynomial sin, cos and exp; results match the libm
+// path of Task::process up to the odd task whose digits land on the other side of a truncation, see do_validation
+namespace simd
+{
+    using batch_kernel = void(*)(const double* vals, size_t count, bool b_heavy, unsigned int* out);
+
+    // The exp of the kernels is only good for x >= 0, which holds from the first iteration on
+    static_assert(LIGHT_ITERATIONS > 0 && HEAVY_ITERATIONS > 0);
+}
+
+#if SIMD_X86
+namespace simd::sse2
+{
+    struct vec
+    {
+        static constexpr size_t width = 2;
+        __m128d v;
+
+        static vec set(double x) { return {_mm_set1_pd(x)}; }
+        static vec load(const double* p) { return {_mm_loadu_pd(p)}; }
+        vec operator+(vec b) const { return {_mm_add_pd(v, b.v)}; }
+        vec operator-(vec b) const { return {_mm_sub_pd(v, b.v)}; }
+        vec operator*(vec b) const { return {_mm_mul_pd(v, b.v)}; }
+        vec operator/(vec b) const { return {_mm_div_pd(v, b.v)}; }
+        // Both only for |x| < 2^31, which is all the kernel needs
+        static vec trunc(vec x) { return {_mm_cvtepi32_pd(_mm_cvttpd_epi32(x.v))}; }
+        static vec round(vec x) { return {_mm_cvtepi32_pd(_mm_cvtpd_epi32(x.v))}; }
+        static vec abs(vec x) { return {_mm_andnot_pd(_mm_set1_pd(-0.), x.v)}; }
+        static vec select_eq(vec a, vec b, vec if_equal, vec otherwise)
+        {
+            const __m128d mask = _mm_cmpeq_pd(a.v, b.v);
+            return {_mm_or_pd(_mm_and_pd(mask, if_equal.v), _mm_andnot_pd(mask, otherwise.v))};
+        }
+        // 2^n for small whole n >= 0, straight into the exponent bits
+        static vec pow2(vec n)
+        {
+            const __m128i n64 = _mm_unpacklo_epi32(_mm_cvttpd_epi32(n.v), _mm_setzero_si128());
+            return {_mm_castsi128_pd(_mm_slli_epi64(_mm_add_epi64(n64, _mm_set1_epi64x(1023)), 52))};
+        }
+        static void store_u32(vec x, unsigned int* out) { _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_cvttpd_epi32(x.v)); }
+    };
+
+#include "SimdKernel.h"
+}
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+namespace simd::avx2
+{
+    struct vec
+    {
+        static constexpr size_t width = 4;
+        __m256d v;
+
+        static vec set(double x) { return {_mm256_set1_pd(x)}; }
+        static vec load(const double* p) { return {_mm256_loadu_pd(p)}; }
+        vec operator+(vec b) const { return {_mm256_add_pd(v, b.v)}; }
+        vec operator-(vec b) const { return {_mm256_sub_pd(v, b.v)}; }
+        vec operator*(vec b) const { return {_mm256_mul_pd(v, b.v)}; }
+        vec operator/(vec b) const { return {_mm256_div_pd(v, b.v)}; }
+        static vec trunc(vec x) { return {_mm256_round_pd(x.v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)}; }
+        static vec round(vec x) { return {_mm256_round_pd(x.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)}; }
+        static vec abs(vec x) { return {_mm256_andnot_pd(_mm256_set1_pd(-0.), x.v)}; }
+        static vec select_eq(vec a, vec b, vec if_equal, vec otherwise)
+        {
+            return {_mm256_blendv_pd(otherwise.v, if_equal.v, _mm256_cmp_pd(a.v, b.v, _CMP_EQ_OQ))};
+        }
+        static vec pow2(vec n)
+        {
+            const __m256i n64 = _mm256_cvtepi32_epi64(_mm256_cvttpd_epi32(n.v));
+            return {_mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(n64, _mm256_set1_epi64x(1023)), 52))};
+        }
+        static void store_u32(vec x, unsigned int* out) { _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_cvttpd_epi32(x.v)); }
+    };
+
+#include "SimdKernel.h"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+namespace simd::avx512
+{
+    struct vec
+    {
+        static constexpr size_t width = 8;
+        __m512d v;
+
+        static vec set(double x) { return {_mm512_set1_pd(x)}; }
+        static vec load(const double* p) { return {_mm512_loadu_pd(p)}; }
+        vec operator+(vec b) const { return {_mm512_add_pd(v, b.v)}; }
+        vec operator-(vec b) const { return {_mm512_sub_pd(v, b.v)}; }
+        vec operator*(vec b) const { return {_mm512_mul_pd(v, b.v)}; }
+        vec operator/(vec b) const { return {_mm512_div_pd(v, b.v)}; }
+        static vec trunc(vec x) { return {_mm512_roundscale_pd(x.v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)}; }
+        static vec round(vec x) { return {_mm512_roundscale_pd(x.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)}; }
+        static vec abs(vec x) { return {_mm512_abs_pd(x.v)}; }
+        static vec select_eq(vec a, vec b, vec if_equal, vec otherwise)
+        {
+            return {_mm512_mask_blend_pd(_mm512_cmp_pd_mask(a.v, b.v, _CMP_EQ_OQ), otherwise.v, if_equal.v)};
+        }
+        static vec pow2(vec n) { return {_mm512_scalef_pd(_mm512_set1_pd(1.), n.v)}; }
+        static void store_u32(vec x, unsigned int* out) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm512_cvttpd_epi32(x.v)); }
+    };
+
+#include "SimdKernel.h"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+#endif
+
+namespace simd
+{
+    // Whether this cpu, and the OS, run the instruction set
+    inline bool supported(simd_level level)
+    {
+#if SIMD_X86
+        switch (level)
+        {
+        case simd_level::scalar:
+        case simd_level::fast:
+        case simd_level::sse2:
+            return true;
+#if defined(_MSC_VER) && !defined(__clang__)
+        case simd_level::avx2:
+        case simd_level::avx512:
+        {
+            int regs[4];
+            __cpuid(regs, 1);
+            // OSXSAVE and AVX, then the OS saving the ymm (and for AVX-512 the zmm and mask) state
+            if((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0)
+                return false;
+            const auto xcr0 = _xgetbv(0);
+            __cpuidex(regs, 7, 0);
+            if(level == simd_level::avx2)
+                return (xcr0 & 0x6) == 0x6 && (regs[1] & (1 << 5)) != 0;
+            return (xcr0 & 0xE6) == 0xE6 && (regs[1] & (1 << 16)) != 0;
+        }
+#else
+        case simd_level::avx2:
+            return __builtin_cpu_supports("avx2");
+        case simd_level::avx512:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+        }
+#else
+        return level == simd_level::scalar || level == simd_level::fast;
+#endif
+    }
+
+    // The widest instruction set supported
+    inline simd_level best_level()
+    {
+        for(const auto level : {simd_level::avx512, simd_level::avx2, simd_level::sse2})
+        {
+            if(supported(level))
+                return level;
+        }
+        return simd_level::scalar;
+    }
+
+    // automatic picks the best_level; throws for an instruction set the cpu does not have
+    inline simd_level resolve(simd_level level)
+    {
+        if(level == simd_level::automatic)
+            return best_level();
+        if(!supported(level))
+            throw std::invalid_argument(std::string{"This cpu does not support the "} + simd_level_name(level) + " kernel");
+        return level;
+    }
+
+    // nullptr for scalar: no batching, Task::process per task
+    inline batch_kernel kernel_for(simd_level level)
+    {
+        switch (resolve(level))
+        {
+        case simd_level::fast:
+            return &fm::process_batch;
+#if SIMD_X86
+        case simd_level::sse2:
+            return &sse2::process_batch;
+        case simd_level::avx2:
+            return &avx2::process_batch;
+        case simd_level::avx512:
+            return &avx512::process_batch;
+#endif
+        default:
+            return nullptr;
+        }
+    }
+}
@@ -0,0 +1,83 @@
+﻿// Body of the batch kernel. Simd.h includes it once per instruction set, inside a namespace that defines vec: a pack
+// of vec::width doubles with set, load, the four arithmetic operators, trunc, round, abs, select_eq, pow2 and store_u32.
+// Only plain adds and multiplies, no fused ones, so every instruction set computes the same numbers.
+// No #pragma once on purpose
+
+// |sin| and |cos| of x >= 0: x = q pi/2 + r with |r| <= pi/4 in three steps (Cody and Waite), then the Cephes
+// polynomials on r. An odd quadrant swaps the two; the signs do not matter to Task::process, it takes the absolute value
+inline void abs_sin_cos(vec x, vec& abs_sin, vec& abs_cos)
+{
+    const vec q = vec::round(x * vec::set(0.63661977236758134308));
+    const vec r = ((x - q * vec::set(2 * 7.85398125648498535156E-1)) - q * vec::set(2 * 3.77489470793079817668E-8)) - q * vec::set(2 * 2.69515142907905952645E-15);
+    const vec z = r * r;
+
+    const vec sin_poly = (((((vec::set(1.58962301576546568060E-10) * z + vec::set(-2.50507477628578072866E-8)) * z
+        + vec::set(2.75573136213857245213E-6)) * z + vec::set(-1.98412698295895385996E-4)) * z
+        + vec::set(8.33333333332211858878E-3)) * z + vec::set(-1.66666666666666307295E-1));
+    const vec cos_poly = (((((vec::set(-1.13585365213876817300E-11) * z + vec::set(2.08757008419747316778E-9)) * z
+        + vec::set(-2.75573141792967388112E-7)) * z + vec::set(2.48015872888517045348E-5)) * z
+        + vec::set(-1.38888888888730564116E-3)) * z + vec::set(4.16666666666665929218E-2));
+    const vec s = r + r * z * sin_poly;
+    const vec c = (vec::set(1.) - vec::set(.5) * z) + z * z * cos_poly;
+
+    const vec odd = q - vec::set(2.) * vec::trunc(q * vec::set(.5));
+    abs_sin = vec::abs(vec::select_eq(odd, vec::set(1.), c, s));
+    abs_cos = vec::abs(vec::select_eq(odd, vec::set(1.), s, c));
+}
+
+// e^x for x >= 0: 2^n e^r with |r| <= ln 2 / 2, Cephes' rational approximation for e^r
+inline vec exp_positive(vec x)
+{
+    const vec n = vec::trunc(x * vec::set(1.4426950408889634073599) + vec::set(.5));
+    x = (x - n * vec::set(6.93145751953125E-1)) - n * vec::set(1.42860682030941723212E-6);
+    const vec xx = x * x;
+    const vec px = x * ((vec::set(1.26177193074810590878E-4) * xx + vec::set(3.02994407707441961300E-2)) * xx + vec::set(9.99999999999999999910E-1));
+    const vec qx = ((vec::set(3.00198505138664455042E-6) * xx + vec::set(2.52448340349684104192E-3)) * xx + vec::set(2.27265548208155028766E-1)) * xx + vec::set(2.00000000000000000009E0);
+    return (vec::set(1.) + vec::set(2.) * (px / (qx - px))) * vec::pow2(n);
+}
+
+// One round of Task::process' loop
+inline vec iterate(vec x)
+{
+    vec unused;
+    vec abs_cos;
+    vec abs_sin;
+    abs_sin_cos(vec::abs(x), unused, abs_cos);
+    abs_sin_cos(abs_cos, abs_sin, unused);
+    const vec digits = vec::trunc(abs_sin * vec::set(10'000'000.));
+    return (digits - vec::trunc(digits / vec::set(100'000.)) * vec::set(100'000.)) / vec::set(10'000.);
+}
+
+// Two packs at a time, so the two dependency chains hide each other's latency
+inline void process_two(const double* vals, size_t iterations, unsigned int* out)
+{
+    vec a = vec::set(2.) * (vec::load(vals) / vec::set(4294967295.)) - vec::set(1.);
+    vec b = vec::set(2.) * (vec::load(vals + vec::width) / vec::set(4294967295.)) - vec::set(1.);
+    for(size_t i = 0; i < iterations; i++)
+    {
+        a = iterate(a);
+        b = iterate(b);
+    }
+    vec::store_u32(exp_positive(a), out);
+    vec::store_u32(exp_positive(b), out + vec::width);
+}
+
+inline void process_batch(const double* vals, size_t count, bool b_heavy, unsigned int* out)
+{
+    constexpr size_t step = 2 * vec::width;
+    const size_t iterations = b_heavy ? HEAVY_ITERATIONS : LIGHT_ITERATIONS;
+    size_t i = 0;
+    for(; i + step <= count; i += step)
+    {
+        process_two(vals + i, iterations, out + i);
+    }
+    if(i < count)
+    {
+        // The tail goes through the same instructions, padded with zeros
+        double padded[step] = {};
+        unsigned int results[step];
+        std::copy(vals + i, vals + count, padded);
+        process_two(padded, iterations, results);
+        std::copy(results, results + (count - i), out + i);
+    }
+}
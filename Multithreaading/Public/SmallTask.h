@@ -0,0 +1,107 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace tk {
+
+// Move-only void() callable; closures up to inline_size bytes live inside the object, bigger ones go to the heap
+class small_task {
+public:
+    static constexpr size_t inline_size = 48;
+
+    template<typename FuncType>
+    static constexpr bool fits_inline =
+        sizeof(FuncType) <= inline_size &&
+        alignof(FuncType) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible_v<FuncType>;
+
+    small_task() noexcept = default;
+
+    template<typename FuncType>
+        requires (!std::is_same_v<std::decay_t<FuncType>, small_task> && std::is_invocable_v<std::decay_t<FuncType>&>)
+    small_task(FuncType&& function) {
+        using func_type = std::decay_t<FuncType>;
+        if constexpr(fits_inline<func_type>) {
+            ::new (static_cast<void*>(storage_)) func_type(std::forward<FuncType>(function));
+            p_vtable_ = &inline_vtable_<func_type>;
+        }
+        else {
+            ::new (static_cast<void*>(storage_)) func_type*(new func_type(std::forward<FuncType>(function)));
+            p_vtable_ = &heap_vtable_<func_type>;
+        }
+    }
+
+    small_task(small_task&& other) noexcept {
+        move_from_(other);
+    }
+
+    small_task& operator=(small_task&& other) noexcept {
+        if(this != &other) {
+            reset();
+            move_from_(other);
+        }
+        return *this;
+    }
+
+    small_task(const small_task&) = delete;
+    small_task& operator=(const small_task&) = delete;
+
+    ~small_task() {
+        reset();
+    }
+
+    void operator()() {
+        p_vtable_->invoke(storage_);
+    }
+
+    explicit operator bool() const noexcept {
+        return p_vtable_ != nullptr;
+    }
+
+    void reset() noexcept {
+        if(p_vtable_) {
+            p_vtable_->destroy(storage_);
+            p_vtable_ = nullptr;
+        }
+    }
+
+private:
+    struct vtable {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src) noexcept;
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template<typename FuncType>
+    static constexpr vtable inline_vtable_ = {
+        [](void* storage) { (*std::launder(static_cast<FuncType*>(storage)))(); },
+        [](void* dst, void* src) noexcept {
+            auto* p_src = std::launder(static_cast<FuncType*>(src));
+            ::new (dst) FuncType(std::move(*p_src));
+            p_src->~FuncType();
+        },
+        [](void* storage) noexcept { std::launder(static_cast<FuncType*>(storage))->~FuncType(); }
+    };
+
+    template<typename FuncType>
+    static constexpr vtable heap_vtable_ = {
+        [](void* storage) { (**static_cast<FuncType**>(storage))(); },
+        [](void* dst, void* src) noexcept { ::new (dst) FuncType*(*static_cast<FuncType**>(src)); },
+        [](void* storage) noexcept { delete *static_cast<FuncType**>(storage); }
+    };
+
+    void move_from_(small_task& other) noexcept {
+        if(other.p_vtable_) {
+            other.p_vtable_->move(storage_, other.storage_);
+            p_vtable_ = std::exchange(other.p_vtable_, nullptr);
+        }
+    }
+
+    alignas(std::max_align_t) std::byte storage_[inline_size];
+    const vtable* p_vtable_ = nullptr;
+};
+
+} // namespace tk
@@ -0,0 +1,167 @@
+﻿#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Constants.h"
+#include "Task.h"
+#include "Numa.h"
+#include "Simd.h"
+
+// Structure of arrays layout of the task data. A Task is a double and a bool padded to 16 bytes; here a chunk is its
+// values back to back plus one heavy bit per task, a little over 8 bytes per task, and the values are laid out
+// for vector loads
+namespace soa
+{
+    inline constexpr size_t HEAVY_WORDS = (CHUNK_SIZE + 63) / 64;
+
+    struct chunk
+    {
+        alignas(CACHE_LINE_SIZE) std::array<double, CHUNK_SIZE> vals;
+        std::array<uint64_t, HEAVY_WORDS> heavy_bits;
+
+        bool is_heavy(size_t i) const
+        {
+            return (heavy_bits[i / 64] >> (i % 64) & 1) != 0;
+        }
+
+        // Heavy tasks in [begin, end), a popcount per word instead of a look at every task
+        size_t count_heavy(size_t begin, size_t end) const
+        {
+            size_t count = 0;
+            while(begin < end)
+            {
+                const size_t word = begin / 64;
+                const size_t word_end = std::min(end, (word + 1) * 64);
+                const size_t width = word_end - begin;
+                const uint64_t mask = width == 64 ? ~uint64_t{0} : ((uint64_t{1} << width) - 1) << (begin % 64);
+                count += static_cast<size_t>(std::popcount(heavy_bits[word] & mask));
+                begin = word_end;
+            }
+            return count;
+        }
+
+        void pack(const Dataset::value_type& tasks)
+        {
+            heavy_bits.fill(0);
+            for(size_t i = 0; i < CHUNK_SIZE; i++)
+            {
+                vals[i] = tasks[i].val;
+                heavy_bits[i / 64] |= uint64_t{tasks[i]._b_heavy} << (i % 64);
+            }
+        }
+    };
+
+    using dataset = std::vector<chunk, numa::page_allocator<chunk>>;
+
+    // [begin, end) of one chunk, the SoA counterpart of a std::span<const Task>
+    struct range
+    {
+        const chunk* p_chunk = nullptr;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    struct tally
+    {
+        unsigned int accumulation = 0;
+        size_t num_heavy_items_processed = 0;
+    };
+
+    inline tally process(const range& tasks)
+    {
+        tally result;
+        if(!tasks.p_chunk)
+            return result;
+
+        const auto& c = *tasks.p_chunk;
+        for(size_t i = tasks.begin; i < tasks.end; i++)
+        {
+            result.accumulation += Task::process(c.vals[i], c.is_heavy(i));
+        }
+        result.num_heavy_items_processed = c.count_heavy(tasks.begin, tasks.end);
+        return result;
+    }
+
+    // Sorts the range into runs of light and runs of heavy tasks for kernel, and hands every result to on_result
+    // together with the index of its task
+    template<typename OnResult>
+    void for_each_result(const range& tasks, simd::batch_kernel kernel, OnResult&& on_result)
+    {
+        constexpr size_t BATCH_SIZE = 256;
+        struct batch
+        {
+            std::array<double, BATCH_SIZE> vals;
+            std::array<size_t, BATCH_SIZE> indices;
+            size_t count = 0;
+        };
+        std::array<batch, 2> batches;
+        std::array<unsigned int, BATCH_SIZE> results;
+
+        const auto flush = [&](bool b_heavy)
+        {
+            auto& b = batches[b_heavy];
+            kernel(b.vals.data(), b.count, b_heavy, results.data());
+            for(size_t k = 0; k < b.count; k++)
+                on_result(b.indices[k], results[k]);
+            b.count = 0;
+        };
+
+        const auto& c = *tasks.p_chunk;
+        for(size_t i = tasks.begin; i < tasks.end; i++)
+        {
+            const bool b_heavy = c.is_heavy(i);
+            auto& b = batches[b_heavy];
+            b.vals[b.count] = c.vals[i];
+            b.indices[b.count] = i;
+            if(++b.count == BATCH_SIZE)
+                flush(b_heavy);
+        }
+        flush(false);
+        flush(true);
+    }
+
+    // Through a batch kernel; nullptr is Task::process per task
+    inline tally process(const range& tasks, simd::batch_kernel kernel)
+    {
+        if(!kernel || !tasks.p_chunk)
+            return process(tasks);
+
+        tally result;
+        for_each_result(tasks, kernel, [&](size_t, unsigned int value)
+        {
+            result.accumulation += value;
+        });
+        result.num_heavy_items_processed = tasks.p_chunk->count_heavy(tasks.begin, tasks.end);
+        return result;
+    }
+
+    // Every chunk cut into the WORKER_COUNT subsets the preassigned workers own; the values are nearly all of a chunk,
+    // so the slices line up with the workers' values closely enough
+    inline numa::sliced_region worker_slices(dataset& chunks)
+    {
+        return { reinterpret_cast<std::byte*>(chunks.data()), chunks.size(), sizeof(chunk), WORKER_COUNT };
+    }
+
+    // Goes through the same chunk_generator as the AoS dataset, so both layouts hold the same tasks
+    inline dataset generate(DatasetType type, const numa::placement& placement = {}, uint64_t seed = DEFAULT_SEED, size_t thread_count = 0, size_t chunk_count = CHUNK_COUNT)
+    {
+        dataset chunks(chunk_count);
+        numa::place(worker_slices(chunks), placement);
+
+        const chunk_generator generator{type, seed};
+        generate_in_parallel(chunks.size(), thread_count, [&](size_t begin, size_t end)
+        {
+            const auto p_tasks = std::make_unique<Dataset::value_type>();
+            for(size_t chunk_index = begin; chunk_index < end; chunk_index++)
+            {
+                generator.fill(*p_tasks, chunk_index);
+                chunks[chunk_index].pack(*p_tasks);
+            }
+        });
+        return chunks;
+    }
+}
@@ -0,0 +1,355 @@
+﻿#pragma once
+#include <iostream>
+#include <thread>
+#include <optional>
+#include <span>
+#include <format>
+#include <atomic>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include "Constants.h"
+#include "Task.h"
+#include "Timing.h"
+#include "Settings.h"
+#include "Barrier.h"
+#include "Stream.h"
+#include "Simd.h"
+#include "../include/MyTimer.h"
+#include "Logging.h"
+
+// Splits every chunk into a light and a heavy lane before the workers start. The light lane is cut into one
+// contiguous run per worker and goes through a batch kernel in one go, no branch per task; the heavy lane is
+// claimed one task at a time, so whoever finishes its light run early picks up the slack
+namespace spl
+{
+    // Interface for the main thread
+    class master_control
+    {
+    public:
+        master_control(barrier_kind barrier = barrier_kind::condvar, simd::batch_kernel kernel = nullptr)
+            :
+            completion_{barrier, WORKER_COUNT},
+            kernel_{kernel}
+        {
+            light_vals_.reserve(CHUNK_SIZE);
+            heavy_vals_.reserve(CHUNK_SIZE);
+        }
+    
+        void signal_done()
+        {
+            LOG(LogMasterControl, Info, "Work completed");
+            completion_.arrive();
+        }
+    
+        // Returns the synchronisation overhead of the chunk
+        float wait_for_all_done()
+        {
+            LOG(LogMasterControl, Info, "Waiting for all other to be done.....");
+            return completion_.wait();
+        }
+
+        // Sorts the chunk's values into the two lanes; runs before the workers are woken, which publishes them
+        void set_chunk(std::span<const Task> chunk)
+        {
+            light_vals_.clear();
+            heavy_vals_.clear();
+            for(const auto& t : chunk)
+            {
+                (t._b_heavy ? heavy_vals_ : light_vals_).push_back(t.val);
+            }
+            next_heavy_.value.store(0, std::memory_order_relaxed);
+        }
+
+        // The worker's contiguous share of the light lane
+        std::span<const double> light_run(size_t worker_index) const
+        {
+            const size_t begin = light_vals_.size() * worker_index / WORKER_COUNT;
+            const size_t end = light_vals_.size() * (worker_index + 1) / WORKER_COUNT;
+            return std::span{light_vals_}.subspan(begin, end - begin);
+        }
+
+        // Next heavy value, or nullptr once the lane is drained. Relaxed is enough: the values were published
+        // with the wake-up and the counter only has to hand out every index once
+        const double* claim_heavy()
+        {
+            const size_t index = next_heavy_.value.fetch_add(1, std::memory_order_relaxed);
+            return index < heavy_vals_.size() ? &heavy_vals_[index] : nullptr;
+        }
+
+        size_t get_light_count() const
+        {
+            return light_vals_.size();
+        }
+
+        size_t get_heavy_count() const
+        {
+            return heavy_vals_.size();
+        }
+
+        // What the light lane runs through, nullptr for Task::process per value
+        simd::batch_kernel get_kernel() const
+        {
+            return kernel_;
+        }
+
+    private:
+        // Every worker claims from it until the lane is drained, keep it off the lanes' cache lines unless PACKED_LAYOUT
+        struct alignas(HOT_FIELD_ALIGNMENT) claim_slot
+        {
+            std::atomic<size_t> value = 0;
+        };
+
+        bar::completion completion_;
+        simd::batch_kernel kernel_;
+        std::vector<double> light_vals_;
+        std::vector<double> heavy_vals_;
+        claim_slot next_heavy_;
+    };
+
+    // Interface for a seaprate thread (joins automatically)
+    class worker
+    {
+    public:
+        worker(const std::shared_ptr<master_control>& sp_mctrl, size_t index, std::optional<unsigned> cpu = {}, wake_mode wake = wake_mode::condvar, std::chrono::microseconds wake_spin = {})
+            :
+            sp_mctrl_{sp_mctrl},
+            index_{index},
+            cpu_{cpu},
+            doorbell_{wake, wake_spin},
+            thread_{&worker::run_, this}
+        {
+        }
+
+        void start_work()
+        {
+            doorbell_.ring([&]
+            {
+                b_working_ = true;
+            });
+        }
+
+        void kill()
+        {
+            doorbell_.ring([&]
+            {
+                LOG(LogWorker, Info, "Killing Worker...");
+                b_dying_ = true;
+            });
+        }
+
+        unsigned int get_result() const
+        {
+            return accumulation_;
+        }
+
+        float get_job_work_time() const
+        {
+            return work_time_;
+        }
+
+        float get_light_time() const
+        {
+            return light_time_;
+        }
+
+        float get_heavy_time() const
+        {
+            return work_time_ - light_time_;
+        }
+
+        size_t get_num_heavy_items_processed() const
+        {
+            return num_heavy_items_processed_;
+        }
+
+        bar::clock::time_point get_start_time() const
+        {
+            return start_time_;
+        }
+
+        ~worker()
+        {
+            kill();
+        }
+
+    private:
+        // Both lanes tally in locals and the worker stores once per chunk, see HOT_FIELD_ALIGNMENT
+        unsigned int process_light_() const
+        {
+            const auto run = sp_mctrl_->light_run(index_);
+            const auto kernel = sp_mctrl_->get_kernel();
+            unsigned int accumulation = 0;
+            if(!kernel)
+            {
+                for(const double val : run)
+                {
+                    accumulation += Task::process(val, false);
+                }
+                return accumulation;
+            }
+
+            constexpr size_t BATCH_SIZE = 256;
+            std::array<unsigned int, BATCH_SIZE> results;
+            for(size_t begin = 0; begin < run.size(); begin += BATCH_SIZE)
+            {
+                const size_t count = std::min(BATCH_SIZE, run.size() - begin);
+                kernel(run.data() + begin, count, false, results.data());
+                for(size_t k = 0; k < count; k++)
+                {
+                    accumulation += results[k];
+                }
+            }
+            return accumulation;
+        }
+
+        unsigned int process_heavy_()
+        {
+            unsigned int accumulation = 0;
+            size_t num_heavy_items_processed = 0;
+            while(const double* p_val = sp_mctrl_->claim_heavy())
+            {
+                accumulation += Task::process(*p_val, true);
+                num_heavy_items_processed++;
+            }
+            num_heavy_items_processed_ = num_heavy_items_processed;
+            return accumulation;
+        }
+
+        void run_()
+        {
+            if(cpu_)
+                topo::pin_current_thread(*cpu_);
+
+            while (true)
+            {
+                MyTimer timer;
+                doorbell_.wait([this] { return b_working_ || b_dying_; });
+
+                if (b_dying_)
+                    break;
+
+                start_time_ = bar::clock::now();
+                timer.Mark();
+
+                LOG(LogWorker, Info, "Process data for Worker");
+                unsigned int accumulation = process_light_();
+                light_time_ = timer.Peek();
+                accumulation += process_heavy_();
+                accumulation_ += accumulation;
+                LOG(LogWorker, Info, "Processed data: {} for Worker", accumulation_);
+
+                work_time_ = timer.Peek();
+
+                b_working_ = false;
+                sp_mctrl_->signal_done();
+            }
+        }
+
+        std::shared_ptr<master_control> sp_mctrl_;
+        size_t index_;
+        std::optional<unsigned> cpu_;
+        bar::doorbell doorbell_;
+
+        // shared memory
+        unsigned int accumulation_ = 0;
+        bool b_dying_ = false;
+        bool b_working_ = false;
+        float work_time_ = -1.f;
+        float light_time_ = 0.f;
+        size_t num_heavy_items_processed_ = 0;
+        bar::clock::time_point start_time_;
+        // Declared last: the thread starts in the constructor and uses every member above
+        std::jthread thread_;
+    };
+
+
+    int do_experiment(stm::chunk_source chunks, const experiment_settings& settings = {})
+    {
+        LOG(LogTemp, Info, "Starting experiment");
+            
+        MyTimer total_timer;
+        total_timer.Mark();
+
+        auto sp_mctrl = std::make_shared<master_control>(settings.barrier, simd::kernel_for(settings.kernel));
+
+        LOG(LogTemp, Info, "Allocate p_workers");
+        
+        std::vector<std::unique_ptr<worker>> p_workers;
+        const auto cpus = topo::cpu_topology::get().plan(settings.aff, WORKER_COUNT);
+        for(size_t j = 0; j < WORKER_COUNT; j++)
+        {
+            p_workers.push_back(std::make_unique<worker>(sp_mctrl, j, cpus[j], settings.wake, settings.wake_spin));
+        }
+
+        std::vector<chunk_timing_info> timings;
+        timings.reserve(CHUNK_COUNT);
+
+        float total_split_time = 0.f;
+        MyTimer chunk_timer;
+        for(const auto& chunk : chunks)
+        {
+            chunk_timer.Mark();
+            sp_mctrl->set_chunk(chunk);
+            total_split_time += chunk_timer.Peek();
+            for(auto& p_worker : p_workers)
+            {
+                p_worker->start_work();
+            }
+            const float sync_overhead = sp_mctrl->wait_for_all_done();
+            
+            // Report timing for threads
+            const auto chunk_time = chunk_timer.Peek();
+            timings.push_back
+            (
+              {}  
+            );
+            float light_span = 0.f;
+            float heavy_span = 0.f;
+            for(size_t i = 0; i < WORKER_COUNT; i++)
+            {
+                timings.back().number_of_heavy_items_per_thread[i] = p_workers[i]->get_num_heavy_items_processed();
+                timings.back().time_spent_working_per_thread[i] = p_workers[i]->get_job_work_time();
+                timings.back().total_chunk_time = chunk_time;
+                light_span = std::max(light_span, p_workers[i]->get_light_time());
+                heavy_span = std::max(heavy_span, p_workers[i]->get_heavy_time());
+            }
+            // A lane takes as long as its slowest worker
+            timings.back().light_lane_throughput = light_span > 0.f ? float(sp_mctrl->get_light_count()) / light_span : 0.f;
+            timings.back().heavy_lane_throughput = heavy_span > 0.f ? float(sp_mctrl->get_heavy_count()) / heavy_span : 0.f;
+            timings.back().sync_overhead = sync_overhead;
+            const auto [it_first, it_last] = std::ranges::minmax_element(p_workers, {}, &worker::get_start_time);
+            timings.back().start_skew = std::chrono::duration<float>((*it_last)->get_start_time() - (*it_first)->get_start_time()).count();
+        }
+
+        const float t = total_timer.Peek();
+        
+        // Accumlate the overall result.
+        unsigned int final_result = 0;
+        LOG_ALWAYS(LogTemp, Info, "Accumulating final result");
+        for(const auto& w : p_workers)
+        {
+            final_result += w->get_result();
+        }
+        LOG_ALWAYS(LogTemp, Info, "Result is {}\n Time taken: {}\n Splitting: {}s\n Light lane kernel: {}", final_result, t, total_split_time,
+            simd_level_name(simd::resolve(settings.kernel)));
+        LOG_ALWAYS(LogTemp, Info, "Lane throughput per chunk: light {:.0f} tasks/s, heavy {:.0f} tasks/s",
+            mean_per_chunk(timings, &chunk_timing_info::light_lane_throughput), mean_per_chunk(timings, &chunk_timing_info::heavy_lane_throughput));
+        LOG_ALWAYS(LogTemp, Info, "Sync overhead per chunk: {}us, start skew: {}us",
+            mean_per_chunk(timings, &chunk_timing_info::sync_overhead) * 1'000'000.f, mean_per_chunk(timings, &chunk_timing_info::start_skew) * 1'000'000.f);
+
+        
+        // Output csv of chunk timings
+        // worktime, idletime, numberofheavies x workers = totaltime, total heavies, lane throughputs
+
+        if constexpr (CHUNK_MEASUREMENT_ENABLED)
+        {
+            write_csv(timings);
+        }
+
+        
+        getchar();
+
+        return 0;
+    }
+}
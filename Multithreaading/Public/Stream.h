@@ -0,0 +1,251 @@
+﻿#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+#include "Constants.h"
+#include "Task.h"
+#include "DatasetFile.h"
+
+namespace stm
+{
+    using clock = std::chrono::steady_clock;
+
+    // A generator thread fills a small ring of reusable chunk buffers while the engine consumes them, so only depth
+    // chunks are ever in memory and the first chunk can be worked on as soon as it is generated. Single consumer:
+    // the engine's master thread
+    class chunk_stream
+    {
+    public:
+        chunk_stream(DatasetType type, const numa::placement& placement, size_t depth, uint64_t seed = DEFAULT_SEED, size_t chunk_count = CHUNK_COUNT)
+            :
+            chunk_count_{chunk_count},
+            start_{clock::now()},
+            buffers_{allocate_data_set(placement, std::max<size_t>(depth, 1))},
+            generator_{type, seed},
+            thread_{&chunk_stream::run_, this}
+        {}
+
+        chunk_stream(const chunk_stream&) = delete;
+        chunk_stream& operator=(const chunk_stream&) = delete;
+
+        ~chunk_stream()
+        {
+            // Wake the generator if it is waiting for a buffer the engine is never going to give back
+            b_stopping_.store(true, std::memory_order_relaxed);
+            released_.fetch_add(1, std::memory_order_release);
+            released_.notify_one();
+        }
+
+        size_t size() const
+        {
+            return chunk_count_;
+        }
+
+        // Next chunk in order, nullptr after the last; gives the chunk handed out before back to the generator
+        const Dataset::value_type* next()
+        {
+            if(handed_ > 0)
+            {
+                if(handed_ == 1)
+                    first_released_ = clock::now();
+                released_.store(handed_, std::memory_order_release);
+                released_.notify_one();
+            }
+            if(handed_ == chunk_count_)
+                return nullptr;
+
+            auto produced = produced_.load(std::memory_order_acquire);
+            if(produced <= handed_)
+            {
+                const auto since = clock::now();
+                do
+                {
+                    produced_.wait(produced, std::memory_order_acquire);
+                    produced = produced_.load(std::memory_order_acquire);
+                } while(produced <= handed_);
+                consumer_wait_ += clock::now() - since;
+            }
+            return &buffers_[handed_++ % buffers_.size()];
+        }
+
+        // Bytes of chunk memory the stream holds, whatever the chunk count
+        size_t buffer_bytes() const
+        {
+            return buffers_.size() * sizeof(Dataset::value_type);
+        }
+
+        // From the construction of the stream until the engine was done with the first chunk
+        float time_to_first_chunk() const
+        {
+            return std::chrono::duration<float>(first_released_ - start_).count();
+        }
+
+        // Seconds the engine waited for a chunk to be generated
+        float consumer_wait() const
+        {
+            return std::chrono::duration<float>(consumer_wait_).count();
+        }
+
+        // Seconds the generator waited for a free buffer; read it once the engine is done
+        float generator_wait() const
+        {
+            return std::chrono::duration<float>(generator_wait_).count();
+        }
+
+    private:
+        void run_()
+        {
+            for(size_t chunk = 0; chunk < chunk_count_ && !b_stopping_.load(std::memory_order_relaxed); chunk++)
+            {
+                auto released = released_.load(std::memory_order_acquire);
+                if(chunk >= released + buffers_.size())
+                {
+                    const auto since = clock::now();
+                    do
+                    {
+                        released_.wait(released, std::memory_order_acquire);
+                        released = released_.load(std::memory_order_acquire);
+                        if(b_stopping_.load(std::memory_order_relaxed))
+                            return;
+                    } while(chunk >= released + buffers_.size());
+                    generator_wait_ += clock::now() - since;
+                }
+                generator_.fill(buffers_[chunk % buffers_.size()]);
+                produced_.store(chunk + 1, std::memory_order_release);
+                produced_.notify_one();
+            }
+        }
+
+        const size_t chunk_count_;
+        const clock::time_point start_;
+        Dataset buffers_;
+        chunk_generator generator_;
+
+        // Chunks the generator has filled, and chunks the engine has given back
+        alignas(HOT_FIELD_ALIGNMENT) std::atomic<size_t> produced_{0};
+        alignas(HOT_FIELD_ALIGNMENT) std::atomic<size_t> released_{0};
+        std::atomic<bool> b_stopping_{false};
+
+        // Consumer side only
+        size_t handed_ = 0;
+        clock::time_point first_released_;
+        clock::duration consumer_wait_{};
+        // Generator side only
+        clock::duration generator_wait_{};
+
+        // Declared last: the thread starts in the constructor and uses every member above
+        std::jthread thread_;
+    };
+
+    // What the experiment engines take their chunks from: a view of a whole dataset, of a stream or of a mapped dataset
+    // file, walked once in order. Engines that need every chunk at once, to look ahead or to index them, ask for dataset()
+    class chunk_source
+    {
+    public:
+        chunk_source(const Dataset& chunks)
+            :
+            p_dataset_{&chunks}
+        {}
+
+        chunk_source(chunk_stream& stream)
+            :
+            p_stream_{&stream}
+        {}
+
+        chunk_source(const dsf::mapped_dataset& file)
+            :
+            p_file_{&file}
+        {}
+
+        size_t size() const
+        {
+            if(p_stream_)
+                return p_stream_->size();
+            return p_file_ ? p_file_->size() : p_dataset_->size();
+        }
+
+        // Whether dataset() works: a generated dataset rather than a stream or a mapped file
+        bool has_dataset() const
+        {
+            return p_dataset_ != nullptr;
+        }
+
+        const Dataset& dataset() const
+        {
+            if(p_stream_)
+                throw std::invalid_argument("This mode needs the whole dataset up front, run it without --stream");
+            if(p_file_)
+                throw std::invalid_argument("This mode needs the dataset generated in memory, run it without --load");
+            return *p_dataset_;
+        }
+
+        // Next chunk in order, nullptr after the last
+        const Dataset::value_type* next()
+        {
+            if(p_stream_)
+                return p_stream_->next();
+            if(position_ == size())
+                return nullptr;
+            return p_file_ ? &p_file_->chunk_array(position_++) : &(*p_dataset_)[position_++];
+        }
+
+        class iterator
+        {
+        public:
+            using value_type = Dataset::value_type;
+            using difference_type = std::ptrdiff_t;
+
+            iterator() = default;
+            iterator(chunk_source* p_source)
+                :
+                p_source_{p_source},
+                p_chunk_{p_source->next()}
+            {}
+
+            const value_type& operator*() const
+            {
+                return *p_chunk_;
+            }
+
+            iterator& operator++()
+            {
+                p_chunk_ = p_source_->next();
+                return *this;
+            }
+
+            void operator++(int)
+            {
+                ++*this;
+            }
+
+            bool operator==(std::default_sentinel_t) const
+            {
+                return p_chunk_ == nullptr;
+            }
+
+        private:
+            chunk_source* p_source_ = nullptr;
+            const value_type* p_chunk_ = nullptr;
+        };
+
+        iterator begin()
+        {
+            return iterator{this};
+        }
+
+        std::default_sentinel_t end() const
+        {
+            return {};
+        }
+
+    private:
+        const Dataset* p_dataset_ = nullptr;
+        chunk_stream* p_stream_ = nullptr;
+        const dsf::mapped_dataset* p_file_ = nullptr;
+        size_t position_ = 0;
+    };
+}
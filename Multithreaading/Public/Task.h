@@ -1,11 +1,18 @@
 ﻿#pragma once
-#include <random>
 #include <array>
+#include <cstdint>
+#include <format>
 #include <ranges>
 #include <cmath>
 #include <numbers>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include "Constants.h"
 #include "Logging.h"
+#include "Numa.h"
+#include "Philox.h"
+#include "ThreadPool.h"
 
 struct Task
 {
@@ -13,19 +20,72 @@ struct Task
     bool _b_heavy;
 
     [[nodiscard]] unsigned int process() const
+    {
+        return process(val, _b_heavy);
+    }
+
+    // The kernel on its own, for layouts that keep values and heavy flags apart
+    [[nodiscard]] static unsigned int process(double val, bool _b_heavy)
     {
         const auto iterations = _b_heavy ? HEAVY_ITERATIONS : LIGHT_ITERATIONS;
-        double intermediate =2 * (static_cast<double>(val) / static_cast<double>(std::numeric_limits<unsigned int>::max())) - 1.;
+        double intermediate = start_(val);
         for(size_t i = 0; i < iterations; i++)
         {
-            const auto digits =  unsigned int (std::abs(std::sin(std::cos(intermediate)) * 10'000'000)) % 100'000;
-            intermediate = double(digits) / 10'000.;
+            intermediate = iterate_(intermediate);
         }
+        return finish_(intermediate);
+    }
+
+    // The same kernel with the iteration count fixed at compile time and the loop fully unrolled
+    template<size_t Iterations>
+    [[nodiscard]] static unsigned int process(double val)
+    {
+        double intermediate = start_(val);
+        [&]<size_t... I>(std::index_sequence<I...>)
+        {
+            ((intermediate = iterate_(intermediate), void(I)), ...);
+        }(std::make_index_sequence<Iterations>{});
+        return finish_(intermediate);
+    }
+
+    // Through the process_kernels table below: the heavy flag picks the instantiation by index, no branch on it
+    [[nodiscard]] static unsigned int process_dispatched(double val, bool _b_heavy);
+
+    [[nodiscard]] unsigned int process_dispatched() const
+    {
+        return process_dispatched(val, _b_heavy);
+    }
+
+private:
+    static double start_(double val)
+    {
+        return 2 * (static_cast<double>(val) / static_cast<double>(std::numeric_limits<unsigned int>::max())) - 1.;
+    }
+
+    static double iterate_(double intermediate)
+    {
+        const auto digits =  unsigned int (std::abs(std::sin(std::cos(intermediate)) * 10'000'000)) % 100'000;
+        return double(digits) / 10'000.;
+    }
+
+    static unsigned int finish_(double intermediate)
+    {
         return unsigned int{ static_cast<unsigned int>(std::exp(intermediate)) };
     }
-    
 };
 
+// Indexed by the heavy flag
+inline constexpr std::array<unsigned int(*)(double), 2> process_kernels
+{
+    &Task::process<LIGHT_ITERATIONS>,
+    &Task::process<HEAVY_ITERATIONS>,
+};
+
+inline unsigned int Task::process_dispatched(double val, bool _b_heavy)
+{
+    return process_kernels[_b_heavy](val);
+}
+
 
 enum class DatasetType
 {
@@ -34,73 +94,194 @@ enum class DatasetType
     stacked
 };
 
+inline constexpr std::array ALL_DATASET_TYPES{DatasetType::random, DatasetType::evenly, DatasetType::stacked};
 
-using Dataset = std::vector<std::array<Task, CHUNK_SIZE>>;
+inline const char* dataset_type_name(DatasetType type)
+{
+    switch (type)
+    {
+    case DatasetType::random: return "random";
+    case DatasetType::evenly: return "evenly";
+    case DatasetType::stacked: return "stacked";
+    default: return "unknown";
+    }
+}
 
-Dataset generate_data_sets_random()
+inline DatasetType parse_dataset_type(const std::string& name)
 {
-    std::minstd_rand rne;
-    std::bernoulli_distribution bernouili_dist{ PROBABILITY_HEAVY };
-    std::uniform_real_distribution r_dist{0., std::numbers::pi};
-    std::vector<std::array<Task, CHUNK_SIZE>> chunks(CHUNK_COUNT);
+    for(const auto type : ALL_DATASET_TYPES)
+    {
+        if(name == dataset_type_name(type))
+            return type;
+    }
+    throw std::invalid_argument{std::format("Unknown dataset type: {}", name)};
+}
 
-    // fill in the data set
-    for(auto& chunk : chunks)
+// Runs check(type, name) for every dataset type, the exit code is 0 when all of them passed
+template<typename CheckType>
+int sweep_dataset_types(CheckType check)
+{
+    bool b_all_passed = true;
+    for(const auto type : ALL_DATASET_TYPES)
     {
-        // Fills each array with random numbers
-        std::ranges::generate(chunk, [&]{return Task{ .val = r_dist(rne), ._b_heavy = bernouili_dist(rne) };});
-        
+        b_all_passed = check(type, dataset_type_name(type)) && b_all_passed;
     }
+    return b_all_passed ? 0 : 1;
+}
+
 
+using Dataset = std::vector<std::array<Task, CHUNK_SIZE>, numa::page_allocator<std::array<Task, CHUNK_SIZE>>>;
+
+// Every chunk cut into the WORKER_COUNT subsets the preassigned workers own
+numa::sliced_region worker_slices(Dataset& chunks)
+{
+    return { reinterpret_cast<std::byte*>(chunks.data()), chunks.size(), sizeof(Dataset::value_type), WORKER_COUNT };
+}
+
+// Nothing is written by the allocation itself, so the placement decides which node each page ends up on
+Dataset allocate_data_set(const numa::placement& placement, size_t chunk_count = CHUNK_COUNT)
+{
+    Dataset chunks(chunk_count);
+    numa::place(worker_slices(chunks), placement);
     return chunks;
 }
 
-Dataset generate_data_sets_evenly()
+// Fills chunks from a counter based generator keyed by the seed: every task is drawn from (seed, chunk, index) alone, so
+// the chunks can be filled in any order on any number of threads, and a seed gives the same dataset on every machine
+class chunk_generator
 {
-    std::minstd_rand rne;
-    std::uniform_real_distribution r_dist{0., std::numbers::pi};
-    std::vector<std::array<Task, CHUNK_SIZE>> chunks(CHUNK_COUNT);
+public:
+    explicit chunk_generator(DatasetType type, uint64_t seed = DEFAULT_SEED)
+        :
+        type_{type},
+        key_{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)}
+    {}
 
-    const int every_nth = int(1. / PROBABILITY_HEAVY);
-    // fill in the data set
-    for(auto& chunk : chunks)
+    // The chunk_index-th chunk of the dataset of this type and seed
+    void fill(Dataset::value_type& chunk, size_t chunk_index) const
     {
-        // Fills each array with random numbers
-        std::ranges::generate(chunk, [&, i = 0]() mutable
+        switch (type_)
+        {
+        case DatasetType::random:
+            for(size_t i = 0; i < chunk.size(); i++)
             {
-            const bool heavy = i++ % every_nth == 0;
-                return Task
-                {
-                    
-                .val = r_dist(rne), ._b_heavy = heavy
-                };
-            });
+                const auto bits = draw_(chunk_index, i);
+                chunk[i] = Task{ .val = to_val_(bits), ._b_heavy = bits[2] < HEAVY_THRESHOLD };
+            }
+            break;
+        case DatasetType::evenly:
+            fill_evenly_(chunk, chunk_index);
+            break;
+        case DatasetType::stacked:
+            fill_evenly_(chunk, chunk_index);
+            // Heavy tasks first; stable so the order does not depend on the standard library
+            std::ranges::stable_partition(chunk, std::identity{}, &Task::_b_heavy);
+            break;
+        default:
+            LOG_ALWAYS(LogTemp, Error, "Unknown Dataset type");
+            throw std::exception("Unknown Dataset type");
+        }
+    }
+
+    // The chunk after the one filled last, for filling a dataset front to back
+    void fill(Dataset::value_type& chunk)
+    {
+        fill(chunk, next_chunk_++);
+    }
+
+private:
+    // A task is heavy when its third word is below PROBABILITY_HEAVY of the 32 bit range
+    static constexpr uint32_t HEAVY_THRESHOLD = static_cast<uint32_t>(PROBABILITY_HEAVY * 4294967296.);
+
+    rng::philox_counter draw_(size_t chunk_index, size_t index) const
+    {
+        const auto chunk = static_cast<uint64_t>(chunk_index);
+        return rng::philox4x32({static_cast<uint32_t>(index), static_cast<uint32_t>(chunk), static_cast<uint32_t>(chunk >> 32), 0}, key_);
     }
 
+    static double to_val_(const rng::philox_counter& bits)
+    {
+        return rng::to_unit(bits[0], bits[1]) * std::numbers::pi;
+    }
+
+    void fill_evenly_(Dataset::value_type& chunk, size_t chunk_index) const
+    {
+        const size_t every_nth = size_t(1. / PROBABILITY_HEAVY);
+        for(size_t i = 0; i < chunk.size(); i++)
+        {
+            chunk[i] = Task{ .val = to_val_(draw_(chunk_index, i)), ._b_heavy = i % every_nth == 0 };
+        }
+    }
+
+    DatasetType type_;
+    rng::philox_key key_;
+    size_t next_chunk_ = 0;
+};
+
+// Calls fill(begin, end) for ranges of a few chunks that together cover [0, chunk_count), spread over thread_count
+// threads (0 for one per physical core); per range rather than per chunk, so fill can keep a scratch buffer per range
+template<typename FillType>
+void generate_in_parallel(size_t chunk_count, size_t thread_count, FillType&& fill)
+{
+    constexpr size_t CHUNKS_PER_RANGE = 4;
+    if(thread_count == 0)
+    {
+        thread_count = topo::default_thread_count();
+    }
+    if(thread_count == 1)
+    {
+        fill(size_t{0}, chunk_count);
+        return;
+    }
+
+    // The calling thread claims ranges as well
+    tk::thread_pool pool{thread_count - 1};
+    pool.parallel_for(size_t{0}, chunk_count, CHUNKS_PER_RANGE, fill);
+}
+
+Dataset generate_data_set(DatasetType type, const numa::placement& placement = {}, uint64_t seed = DEFAULT_SEED, size_t thread_count = 0)
+{
+    const chunk_generator generator{type, seed};
+    auto chunks = allocate_data_set(placement);
+
+    // fill in the data set; the pages are placed already, which thread writes a chunk does not move it
+    generate_in_parallel(chunks.size(), thread_count, [&](size_t begin, size_t end)
+    {
+        for(size_t chunk_index = begin; chunk_index < end; chunk_index++)
+        {
+            generator.fill(chunks[chunk_index], chunk_index);
+        }
+    });
+
     return chunks;
 }
 
-Dataset generate_data_sets_stacked()
+Dataset generate_data_sets_random(const numa::placement& placement = {}, uint64_t seed = DEFAULT_SEED, size_t thread_count = 0)
+{
+    return generate_data_set(DatasetType::random, placement, seed, thread_count);
+}
+
+Dataset generate_data_sets_evenly(const numa::placement& placement = {}, uint64_t seed = DEFAULT_SEED, size_t thread_count = 0)
+{
+    return generate_data_set(DatasetType::evenly, placement, seed, thread_count);
+}
+
+Dataset generate_data_sets_stacked(const numa::placement& placement = {}, uint64_t seed = DEFAULT_SEED, size_t thread_count = 0)
 {
-    auto data = generate_data_sets_evenly();
-    // Partition each chunk in the data
-    for (auto& chunk : data)
-        std::ranges::partition(chunk, std::identity{}, &Task::_b_heavy);
-    
-    return data;
+    return generate_data_set(DatasetType::stacked, placement, seed, thread_count);
 }
 
 // Helper func to call different generare functions
-Dataset generate_data_sets_by_type(DatasetType type)
+Dataset generate_data_sets_by_type(DatasetType type, const numa::placement& placement = {}, uint64_t seed = DEFAULT_SEED, size_t thread_count = 0)
 {
     switch (type)
     {
     case DatasetType::random:
-        return generate_data_sets_random();
+        return generate_data_sets_random(placement, seed, thread_count);
     case DatasetType::evenly:
-        return generate_data_sets_evenly();
+        return generate_data_sets_evenly(placement, seed, thread_count);
     case DatasetType::stacked:
-        return generate_data_sets_stacked();
+        return generate_data_sets_stacked(placement, seed, thread_count);
     default:
             LOG_ALWAYS(LogTemp, Error, "Unknown Dataset type");
             throw std::exception("Unknown Dataset type");
@@ -0,0 +1,683 @@
+﻿#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <thread>
+#include <vector>
+#include "BlockPool.h"
+#include "SmallTask.h"
+#include "Spin.h"
+#include "Topology.h"
+
+namespace tk {
+
+// Growable circular buffer; unlike std::deque it stops allocating once it has reached its working size
+template<typename T>
+class ring_deque {
+public:
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    void push_back(T value) {
+        if(size_ == slots_.size()) {
+            grow_();
+        }
+        slots_[(head_ + size_) & (slots_.size() - 1)] = std::move(value);
+        ++size_;
+    }
+
+    T pop_back() {
+        --size_;
+        return std::move(slots_[(head_ + size_) & (slots_.size() - 1)]);
+    }
+
+    T pop_front() {
+        T value = std::move(slots_[head_]);
+        head_ = (head_ + 1) & (slots_.size() - 1);
+        --size_;
+        return value;
+    }
+
+private:
+    void grow_() {
+        std::vector<T> slots(std::max<size_t>(initial_capacity_, slots_.size() * 2));
+        for(size_t i = 0; i < size_; i++) {
+            slots[i] = std::move(slots_[(head_ + i) & (slots_.size() - 1)]);
+        }
+        slots_ = std::move(slots);
+        head_ = 0;
+    }
+
+    static constexpr size_t initial_capacity_ = 64;
+
+    std::vector<T> slots_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+};
+
+// What an idle worker does before it parks on the condition variable
+struct idle_policy {
+    // Upper and lower bound of the spin phase, the actual budget follows the recently observed idle gaps
+    std::chrono::nanoseconds max_spin = std::chrono::microseconds{50};
+    std::chrono::nanoseconds min_spin = std::chrono::microseconds{1};
+    // std::this_thread::yield calls between spinning and parking
+    size_t yield_count = 8;
+    // Off: always spin for max_spin
+    bool adaptive = true;
+
+    // The old behaviour, park the moment the queues run dry
+    static idle_policy park_immediately() {
+        return {std::chrono::nanoseconds{0}, std::chrono::nanoseconds{0}, 0, false};
+    }
+};
+
+// How idle workers got back to work; latency runs from the latest submission to the worker noticing it
+struct idle_stats {
+    size_t spin_wakeups = 0;
+    size_t yield_wakeups = 0;
+    size_t park_wakeups = 0;
+    std::chrono::nanoseconds mean_wake_latency{0};
+    std::chrono::nanoseconds max_wake_latency{0};
+    std::chrono::nanoseconds mean_park_wake_latency{0};
+};
+
+// Work-stealing pool: every worker owns a deque, outside submissions land in the injection queue
+class thread_pool {
+
+    using task = small_task;
+public:
+    // Defaults to one worker per physical core
+    thread_pool(std::size_t in_workers_count = topo::default_thread_count(), idle_policy in_idle_policy = {}, const topo::affinity& in_affinity = {})
+        : idle_policy_(in_idle_policy) {
+        const auto cpus = topo::cpu_topology::get().plan(in_affinity, in_workers_count);
+        workers_.reserve(in_workers_count);
+        for(size_t i = 0; i < in_workers_count; i++) {
+            workers_.push_back(std::make_unique<worker>(this, i, cpus[i]));
+        }
+        // Workers steal from each other, so every deque has to exist before any thread starts
+        for(auto& worker : workers_) {
+            worker->start();
+        }
+    }
+
+    // The shared state comes from block_pool, so a warmed-up pool submits without touching the heap
+    template<typename FuncType, typename... Params>
+    auto run(FuncType&& function, Params&&... params)
+    {
+        using ret_type = std::invoke_result_t<std::decay_t<FuncType>&, std::decay_t<Params>&...>;
+        std::promise<ret_type> promise{std::allocator_arg, pooled_allocator<ret_type>{}};
+        auto future = promise.get_future();
+
+        push_task_(make_promise_task_(std::move(promise), std::forward<FuncType>(function), std::forward<Params>(params)...));
+        return future;
+    }
+
+    // One future per input, all of them published under a single lock with a single wake-up
+    template<typename FuncType, std::ranges::input_range RangeType>
+    auto run_batch(const FuncType& function, RangeType&& inputs)
+    {
+        using ret_type = std::invoke_result_t<FuncType&, std::decay_t<std::ranges::range_reference_t<RangeType>>&>;
+        std::vector<std::future<ret_type>> futures;
+        std::vector<task> tasks;
+        for(auto&& input : inputs) {
+            std::promise<ret_type> promise{std::allocator_arg, pooled_allocator<ret_type>{}};
+            futures.push_back(promise.get_future());
+            tasks.push_back(make_promise_task_(std::move(promise), function, std::forward<decltype(input)>(input)));
+        }
+
+        push_tasks_(tasks);
+        return futures;
+    }
+
+    // Fire and forget: no future, no shared state, and no allocation as long as the closure fits small_task.
+    // An exception escaping the callable terminates, same as it would on a std::thread.
+    template<typename FuncType, typename... Params>
+    void post(FuncType&& function, Params&&... params)
+    {
+        push_task_(task{
+            [function = std::forward<FuncType>(function), ...params = std::forward<Params>(params)]() mutable
+            {
+                std::invoke(function, params...);
+            }
+        });
+    }
+
+    // Fire and forget for a whole range of callables: one lock, one broadcast
+    template<std::ranges::input_range RangeType>
+    void post_batch(RangeType&& functions)
+    {
+        std::vector<task> tasks;
+        for(auto&& function : functions) {
+            tasks.push_back(task{
+                [function = std::forward<decltype(function)>(function)]() mutable
+                {
+                    std::invoke(function);
+                }
+            });
+        }
+
+        push_tasks_(tasks);
+    }
+
+    // Cuts [begin, end) into grain sized ranges that the workers and the calling thread claim from a shared counter.
+    // function is called as function(i) per index, or as function(range_begin, range_end) once per range if it takes two.
+    // Returns once every range has been processed and rethrows the first exception thrown by function.
+    template<std::integral IndexType, typename FuncType>
+    void parallel_for(IndexType begin, IndexType end, IndexType grain, FuncType&& function)
+    {
+        if(end <= begin) {
+            return;
+        }
+
+        grain = std::max<IndexType>(grain, 1);
+        const size_t range_count = (static_cast<size_t>(end - begin) + static_cast<size_t>(grain) - 1) / static_cast<size_t>(grain);
+
+        using state_type = parallel_for_state_<IndexType, std::remove_reference_t<FuncType>>;
+        auto sp_state = std::make_shared<state_type>(begin, end, grain, range_count, &function);
+
+        // Late helpers only find the counter exhausted, the shared_ptr keeps the state alive for them
+        const size_t helper_count = std::min(workers_.size(), range_count - 1);
+        post_batch(std::views::iota(size_t{0}, helper_count) | std::views::transform([&](size_t) {
+            return [sp_state]{ sp_state->run_ranges(); };
+        }));
+
+        sp_state->run_ranges();
+        for(size_t done = sp_state->done.load(); done != range_count; done = sp_state->done.load()) {
+            sp_state->done.wait(done);
+        }
+
+        if(sp_state->error) {
+            std::rethrow_exception(sp_state->error);
+        }
+    }
+
+    size_t worker_count() const {
+        return workers_.size();
+    }
+
+    // Index of the calling worker; every thread outside the pool shares the extra slot worker_count()
+    size_t current_slot() const {
+        if(tl_current_worker_ && tl_current_worker_->belongs_to(this)) {
+            return tl_current_worker_->index();
+        }
+        return workers_.size();
+    }
+
+    // Wake-up counts and latencies summed over every worker since the pool started
+    idle_stats get_idle_stats() const {
+        idle_stats stats;
+        int64_t total_latency_ns = 0;
+        int64_t total_park_latency_ns = 0;
+        int64_t max_latency_ns = 0;
+        for(const auto& worker : workers_) {
+            const auto& counters = worker->idle_counters();
+            stats.spin_wakeups += counters.spin_wakeups.load(std::memory_order_relaxed);
+            stats.yield_wakeups += counters.yield_wakeups.load(std::memory_order_relaxed);
+            stats.park_wakeups += counters.park_wakeups.load(std::memory_order_relaxed);
+            total_latency_ns += counters.total_latency_ns.load(std::memory_order_relaxed);
+            total_park_latency_ns += counters.total_park_latency_ns.load(std::memory_order_relaxed);
+            max_latency_ns = std::max(max_latency_ns, counters.max_latency_ns.load(std::memory_order_relaxed));
+        }
+
+        const size_t wakeups = stats.spin_wakeups + stats.yield_wakeups + stats.park_wakeups;
+        if(wakeups > 0) {
+            stats.mean_wake_latency = std::chrono::nanoseconds{total_latency_ns / static_cast<int64_t>(wakeups)};
+        }
+        if(stats.park_wakeups > 0) {
+            stats.mean_park_wake_latency = std::chrono::nanoseconds{total_park_latency_ns / static_cast<int64_t>(stats.park_wakeups)};
+        }
+        stats.max_wake_latency = std::chrono::nanoseconds{max_latency_ns};
+        return stats;
+    }
+
+    // Returns once every submitted task, and everything those tasks submitted, has finished running.
+    // The calling thread runs queued tasks itself in the meantime. Never call it from inside a task of this pool,
+    // the calling task is in flight itself and would wait for its own completion.
+    void wait_for_all_done() {
+        assert(current_slot() == workers_.size());
+
+        waiting_count_.fetch_add(1);
+        for(size_t in_flight = in_flight_count_.load(); in_flight != 0; in_flight = in_flight_count_.load()) {
+            if(auto t = try_take_task_(nullptr)) {
+                t();
+                t.reset();
+                finish_task_();
+            }
+            else {
+                in_flight_count_.wait(in_flight);
+            }
+        }
+        waiting_count_.fetch_sub(1);
+    }
+
+    ~thread_pool() {
+        for(auto& worker : workers_) {
+            worker->request_stop();
+        }
+        // Join before any deque goes away, a stopping worker may still be stealing from its peers
+        for(auto& worker : workers_) {
+            worker->join();
+        }
+    }
+
+private:
+    class worker {
+    public:
+        enum class wakeup { spin, yield, park };
+
+        // Written by the owning worker only, read by get_idle_stats
+        struct counters {
+            std::atomic<size_t> spin_wakeups = 0;
+            std::atomic<size_t> yield_wakeups = 0;
+            std::atomic<size_t> park_wakeups = 0;
+            std::atomic<int64_t> total_latency_ns = 0;
+            std::atomic<int64_t> total_park_latency_ns = 0;
+            std::atomic<int64_t> max_latency_ns = 0;
+        };
+
+        worker(thread_pool* pool, size_t index, std::optional<unsigned> cpu)
+            : p_pool_(pool), index_(index), cpu_(cpu), spin_budget_(pool->idle_policy_.max_spin) {}
+
+        void start() {
+            thread_ = std::jthread{std::bind_front(&worker::run_kernel_, this)};
+        }
+
+        void request_stop() {
+            thread_.request_stop();
+        }
+
+        void join() {
+            if(thread_.joinable()) {
+                thread_.join();
+            }
+        }
+
+        bool belongs_to(const thread_pool* pool) const {
+            return p_pool_ == pool;
+        }
+
+        size_t index() const {
+            return index_;
+        }
+
+        std::chrono::nanoseconds spin_budget() const {
+            return spin_budget_;
+        }
+
+        const counters& idle_counters() const {
+            return counters_;
+        }
+
+        void record_idle(std::chrono::nanoseconds idle_time, wakeup kind, std::chrono::nanoseconds latency) {
+            const auto bump = [](auto& counter, auto value) {
+                counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+            };
+            bump(kind == wakeup::spin ? counters_.spin_wakeups : kind == wakeup::yield ? counters_.yield_wakeups : counters_.park_wakeups, size_t{1});
+            bump(counters_.total_latency_ns, latency.count());
+            if(kind == wakeup::park) {
+                bump(counters_.total_park_latency_ns, latency.count());
+            }
+            if(latency.count() > counters_.max_latency_ns.load(std::memory_order_relaxed)) {
+                counters_.max_latency_ns.store(latency.count(), std::memory_order_relaxed);
+            }
+
+            const auto& policy = p_pool_->idle_policy_;
+            if(!policy.adaptive) {
+                return;
+            }
+            // Spin for about twice the typical gap, or barely at all once the gaps outgrow what spinning can cover
+            avg_idle_ns_ += (idle_time.count() - avg_idle_ns_) / 8;
+            const auto typical_gap = std::chrono::nanoseconds{2 * avg_idle_ns_};
+            spin_budget_ = typical_gap <= policy.max_spin ? std::max(typical_gap, policy.min_spin) : policy.min_spin;
+        }
+
+        void push(task t) {
+            std::lock_guard lock{deque_mutex_};
+            tasks_.push_back(std::move(t));
+        }
+
+        template<typename FillType>
+        void fill(FillType&& fill) {
+            std::lock_guard lock{deque_mutex_};
+            fill(tasks_);
+        }
+
+        // Owner end: newest task first, it is the one most likely still in cache
+        task pop() {
+            std::lock_guard lock{deque_mutex_};
+            if(tasks_.empty()) {
+                return {};
+            }
+            return tasks_.pop_back();
+        }
+
+        // Thief end: oldest task first, and never wait on the owner holding the lock
+        task steal() {
+            std::unique_lock lock{deque_mutex_, std::try_to_lock};
+            if(!lock || tasks_.empty()) {
+                return {};
+            }
+            return tasks_.pop_front();
+        }
+
+    private:
+        void run_kernel_(std::stop_token in_stop_token) {
+            if(cpu_) {
+                topo::pin_current_thread(*cpu_);
+            }
+            tl_current_worker_ = this;
+            while(auto task = p_pool_->get_task_(*this, in_stop_token)) {
+                task();
+                // Destroy the closure before reporting, a waiter may free whatever it captured
+                task.reset();
+                p_pool_->finish_task_();
+            }
+            tl_current_worker_ = nullptr;
+        }
+
+        thread_pool* p_pool_;
+        size_t index_;
+        std::optional<unsigned> cpu_;
+        std::chrono::nanoseconds spin_budget_;
+        int64_t avg_idle_ns_ = 0;
+        counters counters_;
+        std::mutex deque_mutex_;
+        ring_deque<task> tasks_;
+        std::jthread thread_;
+    };
+
+    template<typename RetType, typename FuncType, typename... Params>
+    static task make_promise_task_(std::promise<RetType> promise, FuncType&& function, Params&&... params)
+    {
+        return task{
+            [promise = std::move(promise), function = std::forward<FuncType>(function), ...params = std::forward<Params>(params)]() mutable
+            {
+                try
+                {
+                    if constexpr(std::is_void_v<RetType>) {
+                        std::invoke(function, params...);
+                        promise.set_value();
+                    }
+                    else {
+                        promise.set_value(std::invoke(function, params...));
+                    }
+                }
+                catch (...)
+                {
+                    promise.set_exception(std::current_exception());
+                }
+            }
+        };
+    }
+
+    template<typename IndexType, typename FuncType>
+    struct parallel_for_state_ {
+        parallel_for_state_(IndexType begin, IndexType end, IndexType grain, size_t range_count, FuncType* p_function)
+            : begin(begin), end(end), grain(grain), range_count(range_count), p_function(p_function) {}
+
+        void run_ranges() {
+            for(size_t i = next.fetch_add(1); i < range_count; i = next.fetch_add(1)) {
+                const IndexType range_begin = begin + static_cast<IndexType>(i) * grain;
+                const IndexType range_end = i + 1 == range_count ? end : range_begin + grain;
+                try
+                {
+                    if constexpr(std::is_invocable_v<FuncType&, IndexType, IndexType>) {
+                        (*p_function)(range_begin, range_end);
+                    }
+                    else {
+                        for(IndexType idx = range_begin; idx < range_end; ++idx) {
+                            (*p_function)(idx);
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    std::lock_guard lock{error_mutex};
+                    if(!error) {
+                        error = std::current_exception();
+                    }
+                }
+
+                if(done.fetch_add(1) + 1 == range_count) {
+                    done.notify_all();
+                }
+            }
+        }
+
+        const IndexType begin;
+        const IndexType end;
+        const IndexType grain;
+        const size_t range_count;
+        FuncType* const p_function;
+
+        std::atomic<size_t> next = 0;
+        std::atomic<size_t> done = 0;
+        std::mutex error_mutex;
+        std::exception_ptr error;
+    };
+
+    // Runs fill under the lock of the queue this thread publishes to: its own deque or the injection queue
+    template<typename FillType>
+    void publish_(size_t count, FillType&& fill) {
+        in_flight_count_.fetch_add(count);
+
+        const auto counted_fill = [&](ring_deque<task>& queue) {
+            fill(queue);
+            // Counted before the lock is released so a taker can never decrement below zero
+            queued_count_.fetch_add(count);
+        };
+
+        if(tl_current_worker_ && tl_current_worker_->belongs_to(this)) {
+            tl_current_worker_->fill(counted_fill);
+        }
+        else {
+            std::lock_guard lock{injection_mutex_};
+            counted_fill(injection_queue_);
+        }
+
+        // Only worth a clock read when somebody is idle and will measure its wake latency against it
+        if(idle_count_.load(std::memory_order_relaxed) > 0) {
+            last_publish_ns_.store(now_ns_(), std::memory_order_relaxed);
+        }
+
+        // Pairs with the sleeper count bump in park_, one side always sees the other
+        if(sleeping_count_.load() > 0) {
+            std::lock_guard lock{sleep_mutex_};
+            if(count == 1) {
+                cvar_queue_task_.notify_one();
+            }
+            else {
+                cvar_queue_task_.notify_all();
+            }
+        }
+    }
+
+    void push_task_(task t) {
+        publish_(1, [&](ring_deque<task>& queue) {
+            queue.push_back(std::move(t));
+        });
+    }
+
+    void push_tasks_(std::vector<task>& tasks) {
+        if(tasks.empty()) {
+            return;
+        }
+        publish_(tasks.size(), [&](ring_deque<task>& queue) {
+            for(auto& t : tasks) {
+                queue.push_back(std::move(t));
+            }
+        });
+    }
+
+    void finish_task_() {
+        // Pairs with the waiter count bump in wait_for_all_done, so quiescence is never missed
+        if(in_flight_count_.fetch_sub(1) == 1 && waiting_count_.load() > 0) {
+            in_flight_count_.notify_all();
+        }
+    }
+
+    // p_self is null for a thread outside the pool, it has no deque of its own
+    task take_from_injection_(worker* p_self) {
+        std::lock_guard lock{injection_mutex_};
+        if(injection_queue_.empty()) {
+            return {};
+        }
+        task t = injection_queue_.pop_front();
+
+        if(!p_self) {
+            return t;
+        }
+
+        // Grab a fair share in one go so the injection lock is not hit once per task
+        const size_t share = std::min(injection_queue_.size() / workers_.size(), max_injection_batch_);
+        for(size_t i = 0; i < share; i++) {
+            p_self->push(injection_queue_.pop_front());
+        }
+        return t;
+    }
+
+    task find_task_(worker* p_self) {
+        if(p_self) {
+            if(auto t = p_self->pop()) {
+                return t;
+            }
+        }
+        if(auto t = take_from_injection_(p_self)) {
+            return t;
+        }
+        const size_t first_victim = p_self ? p_self->index() + 1 : 0;
+        for(size_t i = 0; i < workers_.size(); i++) {
+            auto& victim = *workers_[(first_victim + i) % workers_.size()];
+            if(&victim == p_self) {
+                continue;
+            }
+            if(auto t = victim.steal()) {
+                return t;
+            }
+        }
+        return {};
+    }
+
+    task try_take_task_(worker* p_self) {
+        task t = find_task_(p_self);
+        if(t) {
+            queued_count_.fetch_sub(1);
+        }
+        return t;
+    }
+
+    task get_task_(worker& self, std::stop_token& in_stop_token) {
+        while(!in_stop_token.stop_requested()) {
+            if(auto t = try_take_task_(&self)) {
+                return t;
+            }
+            idle_(self, in_stop_token);
+        }
+        return {};
+    }
+
+    static int64_t now_ns_() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool has_queued_task_() const {
+        return queued_count_.load(std::memory_order_relaxed) > 0;
+    }
+
+    // Spin, then yield, then park; returns as soon as a task may be available
+    void idle_(worker& self, std::stop_token& in_stop_token) {
+        const int64_t idle_start_ns = now_ns_();
+        idle_count_.fetch_add(1, std::memory_order_relaxed);
+
+        auto kind = worker::wakeup::park;
+        if(spin_(self.spin_budget(), idle_start_ns, in_stop_token)) {
+            kind = worker::wakeup::spin;
+        }
+        else if(yield_(in_stop_token)) {
+            kind = worker::wakeup::yield;
+        }
+        else {
+            park_(in_stop_token);
+        }
+
+        idle_count_.fetch_sub(1, std::memory_order_relaxed);
+        const int64_t wake_ns = now_ns_();
+        const int64_t trigger_ns = std::max(idle_start_ns, last_publish_ns_.load(std::memory_order_relaxed));
+        self.record_idle(std::chrono::nanoseconds{wake_ns - idle_start_ns}, kind, std::chrono::nanoseconds{std::max<int64_t>(wake_ns - trigger_ns, 0)});
+    }
+
+    bool spin_(std::chrono::nanoseconds budget, int64_t idle_start_ns, std::stop_token& in_stop_token) const {
+        if(budget.count() <= 0) {
+            return false;
+        }
+        const int64_t deadline_ns = idle_start_ns + budget.count();
+        while(!in_stop_token.stop_requested()) {
+            // The clock is far more expensive than a pause, so only look at it every so often
+            for(size_t i = 0; i < spins_per_clock_check_; i++) {
+                if(has_queued_task_()) {
+                    return true;
+                }
+                cpu_relax();
+            }
+            if(now_ns_() >= deadline_ns) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool yield_(std::stop_token& in_stop_token) const {
+        for(size_t i = 0; i < idle_policy_.yield_count && !in_stop_token.stop_requested(); i++) {
+            if(has_queued_task_()) {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        return false;
+    }
+
+    void park_(std::stop_token& in_stop_token) {
+        std::unique_lock ulock{sleep_mutex_};
+        sleeping_count_.fetch_add(1);
+        cvar_queue_task_.wait(ulock, in_stop_token, [this]{return queued_count_.load() > 0;});
+        sleeping_count_.fetch_sub(1);
+    }
+
+    static constexpr size_t max_injection_batch_ = 32;
+    static constexpr size_t spins_per_clock_check_ = 64;
+    static inline thread_local worker* tl_current_worker_ = nullptr;
+
+    std::mutex injection_mutex_;
+    ring_deque<task> injection_queue_;
+
+    std::mutex sleep_mutex_;
+    std::condition_variable_any cvar_queue_task_;
+    std::atomic<size_t> sleeping_count_ = 0;
+    std::atomic<size_t> queued_count_ = 0;
+
+    const idle_policy idle_policy_;
+    std::atomic<size_t> idle_count_ = 0;
+    std::atomic<int64_t> last_publish_ns_ = 0;
+
+    // Published and not yet finished, unlike queued_count_ this includes the tasks that are running
+    std::atomic<size_t> in_flight_count_ = 0;
+    std::atomic<size_t> waiting_count_ = 0;
+
+    std::vector<std::unique_ptr<worker>> workers_;
+};
+
+} // namespace tk
@@ -8,26 +8,38 @@
 #include "Logging.h"
 
 
+// Packed builds keep their own file, so both layouts can be compared side by side
+inline constexpr const char* TIMINGS_FILE = PACKED_LAYOUT_ENABLED ? "timings_packed.csv" : "timings.csv";
+
 struct chunk_timing_info
 {
     std::array<float, WORKER_COUNT> time_spent_working_per_thread;
     std::array<size_t, WORKER_COUNT> number_of_heavy_items_per_thread;
+    // Seconds each worker waited for a lock during the chunk, 0 for the lock free engines
+    std::array<float, WORKER_COUNT> lock_wait_per_thread;
     float total_chunk_time;
+    // From the last worker finishing the chunk until the master runs again, 0 when there is no barrier per chunk
+    float sync_overhead;
+    // Spread of the moments the workers started on the chunk, 0 when there is no wake-up per chunk
+    float start_skew;
+    // Tasks per second through the light and the heavy lane of a split chunk, 0 for the engines that mix them
+    float light_lane_throughput;
+    float heavy_lane_throughput;
 };
 
 inline void write_csv(const std::span<const chunk_timing_info> timings)
 {
     // Create a file
-    std::ofstream csv{ "timings.csv", std::ios_base::trunc };
+    std::ofstream csv{ TIMINGS_FILE, std::ios_base::trunc };
     
     LOG(LogTemp, Info, "Start outputing csv file");
     
     for (size_t i = 0; i < WORKER_COUNT; i++)
     {
-        csv << std::format(" work_{0:}, idle_{0:}, heavy_{0:},", i);
+        csv << std::format(" work_{0:}, idle_{0:}, heavy_{0:}, lock_{0:},", i);
     }
 
-    csv << "chunk_time, totalidle, total_heavy\n";
+    csv << "chunk_time, totalidle, total_heavy, sync, start_skew, light_lane, heavy_lane\n";
 
     for(const auto& chunk : timings)
     {
@@ -40,11 +52,24 @@ inline void write_csv(const std::span<const chunk_timing_info> timings)
             
             csv << std::format("{}, {}, ", chunk.time_spent_working_per_thread[i], idle);
             csv << std::format("{},", heavy);
+            csv << std::format("{},", chunk.lock_wait_per_thread[i]);
 
             total_idle += idle;
             total_heavy += heavy;
         }
         
-        csv << std::format("{}, {}, {}\n", chunk.total_chunk_time, total_idle, total_heavy);
+        csv << std::format("{}, {}, {}, {}, {}, {}, {}\n", chunk.total_chunk_time, total_idle, total_heavy, chunk.sync_overhead, chunk.start_skew,
+            chunk.light_lane_throughput, chunk.heavy_lane_throughput);
+    }
+}
+
+// Mean of one of the per chunk measurements, e.g. mean_per_chunk(timings, &chunk_timing_info::sync_overhead)
+inline float mean_per_chunk(const std::span<const chunk_timing_info> timings, float chunk_timing_info::* measurement)
+{
+    float total {0.f};
+    for(const auto& chunk : timings)
+    {
+        total += chunk.*measurement;
     }
+    return timings.empty() ? 0.f : total / float(timings.size());
 }
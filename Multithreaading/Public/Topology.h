@@ -0,0 +1,326 @@
+﻿#pragma once
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace topo
+{
+    // Where the threads of a pool or an experiment go
+    enum class affinity_policy
+    {
+        none,           // leave it to the OS
+        compact,        // fill a package core by core, hyperthread siblings next to each other
+        scatter,        // round robin over packages, then cores, siblings last
+        physical_cores, // one logical cpu per physical core
+        explicit_list   // exactly the cpus in affinity::cpus
+    };
+
+    struct affinity
+    {
+        affinity_policy policy = affinity_policy::none;
+        std::vector<unsigned> cpus;
+    };
+
+    struct logical_cpu
+    {
+        unsigned id;
+        unsigned core;
+        unsigned package;
+        unsigned node;
+    };
+
+    // "0-3,8,10-11" as found in /sys/devices/system/cpu/online and the node cpulists. Every id has to be below cpu_limit,
+    // anything malformed throws std::invalid_argument
+    inline std::vector<unsigned> parse_cpu_list(const std::string& list, unsigned cpu_limit = std::numeric_limits<unsigned>::max())
+    {
+        const auto parse_id = [&](const std::string& text)
+        {
+            const auto begin = text.find_first_not_of(" \n\t");
+            const auto end = text.find_last_not_of(" \n\t") + 1;
+            unsigned id = 0;
+            const auto [p_end, ec] = begin == std::string::npos ? std::from_chars_result{ nullptr, std::errc::invalid_argument }
+                : std::from_chars(text.data() + begin, text.data() + end, id);
+            if(ec != std::errc{} || p_end != text.data() + end)
+                throw std::invalid_argument("Bad cpu id '" + text + "' in cpu list: " + list);
+            if(id >= cpu_limit)
+                throw std::invalid_argument("Cpu " + std::to_string(id) + " out of range in cpu list: " + list);
+            return id;
+        };
+
+        std::vector<unsigned> cpus;
+        if(list.find_first_not_of(" \n\t") == std::string::npos)
+            return cpus;
+
+        size_t pos = 0;
+        while(pos <= list.size())
+        {
+            const auto comma = std::min(list.find(',', pos), list.size());
+            const auto item = list.substr(pos, comma - pos);
+            pos = comma + 1;
+
+            const auto dash = item.find('-');
+            const unsigned first = parse_id(item.substr(0, dash));
+            const unsigned last = dash == std::string::npos ? first : parse_id(item.substr(dash + 1));
+            if(first > last)
+                throw std::invalid_argument("Descending range '" + item + "' in cpu list: " + list);
+            // last is below cpu_limit, so the loop ends
+            for(unsigned cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    class cpu_topology
+    {
+    public:
+        // Discovered once from /sys/devices/system/cpu, a flat layout of hardware_concurrency cpus elsewhere
+        static const cpu_topology& get()
+        {
+            static const cpu_topology topology;
+            return topology;
+        }
+
+        const std::vector<logical_cpu>& cpus() const
+        {
+            return cpus_;
+        }
+
+        size_t logical_count() const
+        {
+            return cpus_.size();
+        }
+
+        size_t physical_core_count() const
+        {
+            std::set<std::pair<unsigned, unsigned>> cores;
+            for(const auto& cpu : cpus_)
+                cores.emplace(cpu.package, cpu.core);
+            return cores.size();
+        }
+
+        size_t package_count() const
+        {
+            std::set<unsigned> packages;
+            for(const auto& cpu : cpus_)
+                packages.insert(cpu.package);
+            return packages.size();
+        }
+
+        size_t node_count() const
+        {
+            std::set<unsigned> nodes;
+            for(const auto& cpu : cpus_)
+                nodes.insert(cpu.node);
+            return nodes.size();
+        }
+
+        const logical_cpu* find(unsigned id) const
+        {
+            const auto it = std::ranges::find(cpus_, id, &logical_cpu::id);
+            return it == cpus_.end() ? nullptr : &*it;
+        }
+
+        // The cpu for each of thread_count threads, nullopt everywhere when the policy leaves placement to the OS
+        std::vector<std::optional<unsigned>> plan(const affinity& aff, size_t thread_count) const
+        {
+            std::vector<unsigned> order;
+            switch (aff.policy)
+            {
+            case affinity_policy::none:
+                return std::vector<std::optional<unsigned>>(thread_count);
+            case affinity_policy::compact:
+                order = order_by_([](const ranked_cpu& c){ return std::tuple{c.cpu.package, c.core_rank, c.thread_rank}; });
+                break;
+            case affinity_policy::scatter:
+                order = order_by_([](const ranked_cpu& c){ return std::tuple{c.thread_rank, c.core_rank, c.cpu.package}; });
+                break;
+            case affinity_policy::physical_cores:
+                order = order_by_([](const ranked_cpu& c){ return std::tuple{c.thread_rank, c.cpu.package, c.core_rank}; });
+                order.resize(physical_core_count());
+                break;
+            case affinity_policy::explicit_list:
+                order = aff.cpus;
+                break;
+            }
+
+            if(order.empty())
+                throw std::invalid_argument("Affinity policy selected no cpus");
+
+            std::vector<std::optional<unsigned>> cpus(thread_count);
+            for(size_t i = 0; i < thread_count; i++)
+                cpus[i] = order[i % order.size()];
+            return cpus;
+        }
+
+    private:
+        struct ranked_cpu
+        {
+            logical_cpu cpu;
+            unsigned core_rank;   // position of the core within its package
+            unsigned thread_rank; // position of the cpu among its hyperthread siblings
+        };
+
+        cpu_topology()
+        {
+            discover_sysfs_();
+            if(cpus_.empty())
+            {
+                const unsigned count = std::max(1u, std::thread::hardware_concurrency());
+                for(unsigned id = 0; id < count; id++)
+                    cpus_.push_back({ .id = id, .core = id, .package = 0, .node = 0 });
+            }
+            std::ranges::sort(cpus_, {}, [](const logical_cpu& c){ return std::tuple{c.package, c.core, c.id}; });
+        }
+
+        void discover_sysfs_()
+        {
+            namespace fs = std::filesystem;
+            const fs::path cpu_root = "/sys/devices/system/cpu";
+            std::error_code ec;
+            if(!fs::exists(cpu_root / "online", ec))
+                return;
+
+            const auto read_line = [](const fs::path& path) -> std::string
+            {
+                std::ifstream file{ path };
+                std::string line;
+                std::getline(file, line);
+                return line;
+            };
+            const auto read_unsigned = [&](const fs::path& path, unsigned fallback)
+            {
+                const auto line = read_line(path);
+                return line.empty() ? fallback : static_cast<unsigned>(std::stoul(line));
+            };
+
+            std::vector<unsigned> node_of_cpu;
+            const fs::path node_root = "/sys/devices/system/node";
+            if(fs::exists(node_root, ec))
+            {
+                for(const auto& entry : fs::directory_iterator{ node_root, ec })
+                {
+                    const auto name = entry.path().filename().string();
+                    if(!name.starts_with("node") || name.find_first_not_of("0123456789", 4) != std::string::npos)
+                        continue;
+                    const unsigned node = static_cast<unsigned>(std::stoul(name.substr(4)));
+                    for(const auto cpu : parse_cpu_list(read_line(entry.path() / "cpulist")))
+                    {
+                        if(cpu >= node_of_cpu.size())
+                            node_of_cpu.resize(cpu + 1, 0);
+                        node_of_cpu[cpu] = node;
+                    }
+                }
+            }
+
+            for(const auto id : parse_cpu_list(read_line(cpu_root / "online")))
+            {
+                const auto topology_dir = cpu_root / ("cpu" + std::to_string(id)) / "topology";
+                cpus_.push_back({
+                    .id = id,
+                    .core = read_unsigned(topology_dir / "core_id", id),
+                    .package = read_unsigned(topology_dir / "physical_package_id", 0),
+                    .node = id < node_of_cpu.size() ? node_of_cpu[id] : 0
+                });
+            }
+        }
+
+        template<typename KeyType>
+        std::vector<unsigned> order_by_(KeyType key) const
+        {
+            // cpus_ is sorted by package, core and id, so ranks fall out of a single pass
+            std::vector<ranked_cpu> ranked;
+            unsigned core_rank = 0;
+            unsigned thread_rank = 0;
+            for(size_t i = 0; i < cpus_.size(); i++)
+            {
+                const auto& cpu = cpus_[i];
+                if(i > 0)
+                {
+                    const auto& prev = cpus_[i - 1];
+                    if(prev.package != cpu.package)
+                    {
+                        core_rank = 0;
+                        thread_rank = 0;
+                    }
+                    else if(prev.core != cpu.core)
+                    {
+                        core_rank++;
+                        thread_rank = 0;
+                    }
+                    else
+                    {
+                        thread_rank++;
+                    }
+                }
+                ranked.push_back({ cpu, core_rank, thread_rank });
+            }
+
+            std::ranges::stable_sort(ranked, {}, key);
+            std::vector<unsigned> order;
+            for(const auto& r : ranked)
+                order.push_back(r.cpu.id);
+            return order;
+        }
+
+        std::vector<logical_cpu> cpus_;
+    };
+
+    // Best effort: false when the platform has no way to pin, or the cpu is not available to us
+    inline bool pin_current_thread(unsigned cpu)
+    {
+#if defined(_WIN32)
+        if(cpu >= sizeof(DWORD_PTR) * 8)
+            return false;
+        return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR{ 1 } << cpu) != 0;
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        (void)cpu;
+        return false;
+#endif
+    }
+
+    // Thread count that matches the machine: one per physical core
+    inline size_t default_thread_count()
+    {
+        return std::max<size_t>(1, cpu_topology::get().physical_core_count());
+    }
+
+    // none, compact, scatter, cores, or an explicit cpu list such as "0,2,4-7"
+    inline affinity parse_affinity(const std::string& text)
+    {
+        if(text == "none") return {};
+        if(text == "compact") return { .policy = affinity_policy::compact, .cpus = {} };
+        if(text == "scatter") return { .policy = affinity_policy::scatter, .cpus = {} };
+        if(text == "cores") return { .policy = affinity_policy::physical_cores, .cpus = {} };
+        if(text.find_first_not_of("0123456789,- ") == std::string::npos)
+            return { .policy = affinity_policy::explicit_list, .cpus = parse_cpu_list(text, static_cast<unsigned>(cpu_topology::get().logical_count())) };
+        throw std::invalid_argument("Unknown affinity: " + text);
+    }
+}
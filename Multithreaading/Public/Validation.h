@@ -0,0 +1,96 @@
+﻿#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <utility>
+#include "Simd.h"
+#include "Soa.h"
+#include "../include/MyTimer.h"
+
+namespace simd
+{
+    // Share of tasks a batch kernel may disagree with Task::process on. The vector kernels are off from libm by an ulp
+    // or two and fast by up to 1e-13, which only matters when an iteration lands that close to a truncation; none of
+    // the generated datasets has hit one, the tolerance leaves room for a libm that rounds differently
+    inline constexpr double MISMATCH_TOLERANCE = 1e-4;
+
+    struct validation_result
+    {
+        size_t task_count = 0;
+        size_t mismatches = 0;
+        unsigned int max_abs_diff = 0;
+        float scalar_time = 0.f;
+        float kernel_time = 0.f;
+    };
+
+    // Every task of the dataset through the kernel, against Task::process
+    inline validation_result validate(const soa::dataset& chunks, batch_kernel kernel)
+    {
+        validation_result result;
+        for(const auto& c : chunks)
+        {
+            soa::for_each_result({&c, 0, CHUNK_SIZE}, kernel, [&](size_t i, unsigned int value)
+            {
+                const unsigned int expected = Task::process(c.vals[i], c.is_heavy(i));
+                if(value != expected)
+                {
+                    result.mismatches++;
+                    result.max_abs_diff = std::max(result.max_abs_diff, value > expected ? value - expected : expected - value);
+                }
+            });
+            result.task_count += CHUNK_SIZE;
+        }
+
+        // Both sums go to a volatile so neither timed loop is optimized away
+        [[maybe_unused]] volatile unsigned int sink = 0;
+        MyTimer timer;
+        timer.Mark();
+        unsigned int scalar_sum = 0;
+        for(const auto& c : chunks)
+        {
+            scalar_sum += soa::process({&c, 0, CHUNK_SIZE}).accumulation;
+        }
+        result.scalar_time = timer.Mark();
+
+        unsigned int kernel_sum = 0;
+        for(const auto& c : chunks)
+        {
+            kernel_sum += soa::process({&c, 0, CHUNK_SIZE}, kernel).accumulation;
+        }
+        result.kernel_time = timer.Mark();
+
+        sink = scalar_sum + kernel_sum;
+        return result;
+    }
+
+    // Every supported kernel on every dataset on one thread; non zero when a kernel is past the MISMATCH_TOLERANCE
+    inline int do_validation(const numa::placement& placement, uint64_t seed = DEFAULT_SEED)
+    {
+        constexpr std::array levels{simd_level::sse2, simd_level::avx2, simd_level::avx512, simd_level::fast};
+
+        std::cout << std::format("{:<10}{:<8}{:>12}{:>12}{:>10}{:>11}{:>11}{:>9}\n", "dataset", "kernel", "tasks", "mismatches", "max diff", "scalar", "kernel", "speedup");
+        return sweep_dataset_types([&](DatasetType type, const char* name)
+        {
+            const auto chunks = soa::generate(type, placement, seed);
+            bool all_within = true;
+            for(const auto level : levels)
+            {
+                if(!supported(level))
+                {
+                    std::cout << std::format("{:<10}{:<8}   not supported by this cpu\n", name, simd_level_name(level));
+                    continue;
+                }
+
+                const auto r = validate(chunks, kernel_for(level));
+                const bool within = double(r.mismatches) <= MISMATCH_TOLERANCE * double(r.task_count);
+                all_within = all_within && within;
+                std::cout << std::format("{:<10}{:<8}{:>12}{:>12}{:>10}{:>10.4f}s{:>10.4f}s{:>8.2f}x{}\n", name, simd_level_name(level),
+                    r.task_count, r.mismatches, r.max_abs_diff, r.scalar_time, r.kernel_time,
+                    r.kernel_time > 0.f ? r.scalar_time / r.kernel_time : 0.f, within ? "" : "   OVER TOLERANCE");
+            }
+            return all_within;
+        });
+    }
+}